@@ -0,0 +1,659 @@
+// tsm-bench - libtsm parser/screen throughput
+//
+// Replays byte streams through tsm_vte_input() and tsm_screen_draw() and
+// prints one line of key=value pairs per corpus. Without arguments a set of
+// generated corpora is used; otherwise each file is replayed as captured pty
+// output, e.g. recorded with `script -q -c 'ls -R /usr' ls.raw`.
+// The generated set ends with a symbol table run that interns, looks up and
+// resolves BENCH_CLUSTERS distinct combining-mark clusters, and a search run
+// over the scroll-back filled by the text corpus.
+//
+// usage: tsm-bench [-r reps] [-d chunks-per-draw] [-s sb-lines] [-m sb-bytes]
+//                  [file...]
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tsm/libtsm.h"
+#include "tsm/libtsm-int.h"
+
+#define BENCH_COLS 200
+#define BENCH_ROWS 50
+#define BENCH_SB 5000
+#define BENCH_CHUNK 4096
+#define BENCH_SIZE (4 << 20)
+#define BENCH_FRAMES 1000
+#define BENCH_DRAW 16
+#define BENCH_CLUSTERS 1000000
+
+/* allocation counters; libtsm is linked in statically so wrapping the libc
+ * allocator here sees all of its calls */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static struct {
+  unsigned long long allocs;
+  unsigned long long frees;
+  unsigned long long bytes;
+} mstat;
+
+void *malloc(size_t size) {
+  mstat.allocs++;
+  mstat.bytes += size;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  mstat.allocs++;
+  mstat.bytes += nmemb * size;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  mstat.allocs++;
+  mstat.bytes += size;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  if (ptr)
+    mstat.frees++;
+  __libc_free(ptr);
+}
+
+struct buf {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+static void buf_printf(struct buf *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void buf_grow(struct buf *b, size_t need) {
+  while (b->cap - b->len < need)
+    b->cap = b->cap ? b->cap * 2 : 65536;
+  b->data = realloc(b->data, b->cap);
+  if (!b->data) {
+    perror("realloc");
+    exit(1);
+  }
+}
+
+/* formats once into the free space and again after growing if it did not
+ * fit, including the terminating NUL */
+static void buf_printf(struct buf *b, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  if (b->cap - b->len < 256)
+    buf_grow(b, 256);
+  va_start(ap, fmt);
+  n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+  va_end(ap);
+  if (n < 0) {
+    perror("vsnprintf");
+    exit(1);
+  }
+  if ((size_t)n >= b->cap - b->len) {
+    buf_grow(b, (size_t)n + 1);
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+  }
+  b->len += n;
+}
+
+static uint32_t rnd_state = 1;
+
+static uint32_t rnd(void) {
+  rnd_state = rnd_state * 1103515245 + 12345;
+  return rnd_state >> 16;
+}
+
+/* htop/vim style redraws: cursor positioning, SGR changes and short text */
+static void gen_csi(struct buf *b) {
+  while (b->len < BENCH_SIZE) {
+    buf_printf(b, "\033[%u;%uH", rnd() % BENCH_ROWS + 1,
+               rnd() % BENCH_COLS + 1);
+    switch (rnd() % 4) {
+    case 0:
+      buf_printf(b, "\033[0;1;%um", 30 + rnd() % 8);
+      break;
+    case 1:
+      buf_printf(b, "\033[38;5;%u;48;5;%um", rnd() % 256, rnd() % 256);
+      break;
+    case 2:
+      buf_printf(b, "\033[38;2;%u;%u;%um", rnd() % 256, rnd() % 256,
+                 rnd() % 256);
+      break;
+    default:
+      buf_printf(b, "\033[K\033[7m");
+      break;
+    }
+    buf_printf(b, "%.*s\033[m", (int)(rnd() % 12),
+               "load 0.42 cpu[|||   ]");
+  }
+}
+
+/* plain scrolling text */
+static void gen_text(struct buf *b) {
+  static const char *words[] = {"the", "quick", "brown", "fox", "jumps",
+                                "over", "lazy", "dog", "terminal", "line"};
+  unsigned int col = 0;
+  const char *w;
+
+  while (b->len < BENCH_SIZE) {
+    if (col > 70 + rnd() % 40) {
+      buf_printf(b, "\r\n");
+      col = 0;
+    }
+    w = words[rnd() % 10];
+    col += strlen(w) + 1;
+    buf_printf(b, "%s ", w);
+  }
+}
+
+/* CJK and emoji heavy log lines */
+static void gen_utf8(struct buf *b) {
+  static const char *words[] = {"\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e",
+                                "\xe3\x83\xad\xe3\x82\xb0",
+                                "\xec\x84\x9c\xeb\xb2\x84",
+                                "\xe9\x94\x99\xe8\xaf\xaf",
+                                "\xf0\x9f\x9a\x80", "\xf0\x9f\x94\xa5",
+                                "ok", "\xc3\xa9t\xc3\xa9"};
+
+  while (b->len < BENCH_SIZE) {
+    buf_printf(b, "[%05u] ", rnd());
+    for (int i = 0; i < 12; i++)
+      buf_printf(b, "%s", words[rnd() % 8]);
+    buf_printf(b, "\r\n");
+  }
+}
+
+/* emit @n copies of the UTF-8 character @ch, like ncurses with or without rep */
+static void put_run(struct buf *b, const char *ch, unsigned int n, int rep) {
+  if (rep && n > 4) {
+    buf_printf(b, "%s\033[%ub", ch, n - 1);
+    return;
+  }
+  while (n--)
+    buf_printf(b, "%s", ch);
+}
+
+/* full-screen curses redraws: boxes, separators and a few text fields; always
+ * the same number of frames so runs with and without rep can be compared */
+static void gen_curses(struct buf *b, int rep) {
+  unsigned int y, frame;
+
+  for (frame = 0; frame < BENCH_FRAMES; frame++) {
+    buf_printf(b, "\033[H\033[2J\033[1;44;37m\u250c");
+    put_run(b, "\u2500", BENCH_COLS - 2, rep);
+    buf_printf(b, "\u2510");
+    for (y = 2; y < BENCH_ROWS; y++) {
+      buf_printf(b, "\033[%u;1H\u2502\033[0m", y);
+      if (y % 8 == 0) {
+        put_run(b, "\u2500", BENCH_COLS - 2, rep);
+      } else {
+        buf_printf(b, " item %5u ", rnd() % 100000);
+        put_run(b, " ", BENCH_COLS - 14, rep);
+      }
+      buf_printf(b, "\033[1;44;37m\u2502");
+    }
+    buf_printf(b, "\033[%u;1H\u2514", BENCH_ROWS);
+    put_run(b, "\u2500", BENCH_COLS - 2, rep);
+    buf_printf(b, "\u2518\033[0m");
+  }
+}
+
+/* vim scrolling through a file: scroll region, reverse/forward index,
+ * syntax highlighted line redraws and a status line */
+static void gen_vim(struct buf *b) {
+  static const char *kw[] = {"static", "int", "return", "if", "for", "struct"};
+  unsigned int line = 1;
+
+  buf_printf(b, "\033[?1049h\033[1;%ur", BENCH_ROWS - 1);
+  while (b->len < BENCH_SIZE) {
+    if (rnd() % 2) {
+      buf_printf(b, "\033[%u;1H\n\033[%u;1H", BENCH_ROWS - 1, BENCH_ROWS - 1);
+      line++;
+    } else {
+      buf_printf(b, "\033[1;1H\033M");
+      if (line > 1)
+        line--;
+    }
+    buf_printf(b, "\033[33m%4u \033[m\033[38;5;%um%s\033[m %s_%u(\033[31m%u\033[m);"
+               "\033[K",
+               line, 1 + rnd() % 6, kw[rnd() % 6], "name", rnd() % 100,
+               rnd() % 1000);
+    buf_printf(b, "\033[%u;1H\033[7mbench.c [+]%*u,%u\033[m", BENCH_ROWS,
+               BENCH_COLS - 20, line, rnd() % 80);
+  }
+  buf_printf(b, "\033[r\033[?1049l");
+}
+
+/* ls -R --color: directory headers and colored names */
+static void gen_ls(struct buf *b) {
+  static const char *colors[] = {"01;34", "01;32", "01;36", "00", "01;31"};
+  unsigned int n, col;
+
+  while (b->len < BENCH_SIZE) {
+    buf_printf(b, "\r\n./usr/share/doc/pkg%u:\r\n", rnd() % 10000);
+    for (n = 4 + rnd() % 20, col = 0; n--; ) {
+      if (col > BENCH_COLS - 24) {
+        buf_printf(b, "\r\n");
+        col = 0;
+      }
+      buf_printf(b, "\033[0m\033[%sm%-18.*s\033[0m  ", colors[rnd() % 5],
+                 (int)(4 + rnd() % 14), "changelog.Debian.gz");
+      col += 20;
+    }
+    buf_printf(b, "\r\n");
+  }
+}
+
+/* gcc -fdiagnostics-color output: warnings with source excerpts and carets */
+static void gen_cc(struct buf *b) {
+  while (b->len < BENCH_SIZE) {
+    buf_printf(b, "\033[01m\033[Ksrc/mod%u.c:%u:%u:\033[m\033[K "
+               "\033[01;35m\033[Kwarning: \033[m\033[Kunused variable "
+               "\033[01m\033[K\u2018tmp%u\u2019\033[m\033[K "
+               "[\033[01;35m\033[K-Wunused-variable\033[m\033[K]\r\n",
+               rnd() % 50, rnd() % 2000, rnd() % 40, rnd() % 10);
+    buf_printf(b, "  %4u |   int \033[01;35m\033[Ktmp%u\033[m\033[K = 0;\r\n"
+               "       |       \033[01;35m\033[K^~~~\033[m\033[K\r\n",
+               rnd() % 2000, rnd() % 10);
+  }
+}
+
+static void gen_curses_norep(struct buf *b) {
+  gen_curses(b, 0);
+}
+
+static void gen_curses_rep(struct buf *b) {
+  gen_curses(b, 1);
+}
+
+static const struct {
+  const char *name;
+  void (*gen)(struct buf *b);
+} workloads[] = {
+  {"csi", gen_csi},
+  {"text", gen_text},
+  {"utf8", gen_utf8},
+  {"curses", gen_curses_norep},
+  {"curses-rep", gen_curses_rep},
+  {"vim", gen_vim},
+  {"ls", gen_ls},
+  {"cc", gen_cc},
+};
+
+static void write_cb(struct tsm_vte *vte, const char *u8, size_t len,
+                     void *data) {
+  (void)vte;
+  (void)u8;
+  (void)len;
+  (void)data;
+}
+
+static int draw_cb(struct tsm_screen *con, uint64_t id, const uint32_t *ch,
+                   size_t len, unsigned int width, unsigned int posx,
+                   unsigned int posy, const struct tsm_screen_attr *attr,
+                   tsm_age_t age, void *data) {
+  (void)con;
+  (void)id;
+  (void)ch;
+  (void)len;
+  (void)width;
+  (void)posx;
+  (void)posy;
+  (void)attr;
+  (void)age;
+  (void)data;
+  return 0;
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int draw_every = BENCH_DRAW;
+static unsigned int sb_lines = BENCH_SB;
+static size_t sb_bytes;
+
+/* feed @b in pty-sized chunks, drawing every draw_every chunks and once at the
+ * end like a terminal would; returns the elapsed time */
+static double run(const struct buf *b, unsigned int *draws) {
+  struct tsm_screen *screen;
+  struct tsm_vte *vte;
+  size_t pos, n, chunks = 0;
+  double t;
+
+  if (tsm_screen_new(&screen, NULL, NULL) < 0 ||
+      tsm_vte_new(&vte, screen, write_cb, NULL, NULL, NULL) < 0) {
+    fprintf(stderr, "cannot create screen\n");
+    exit(1);
+  }
+  tsm_screen_set_max_sb(screen, sb_lines);
+  if (sb_bytes && tsm_screen_set_sb_budget(screen, sb_bytes) < 0) {
+    fprintf(stderr, "cannot set scroll-back budget\n");
+    exit(1);
+  }
+  tsm_screen_resize(screen, BENCH_COLS, BENCH_ROWS);
+
+  *draws = 0;
+  t = now();
+  for (pos = 0; pos < b->len; pos += n) {
+    n = b->len - pos < BENCH_CHUNK ? b->len - pos : BENCH_CHUNK;
+    tsm_vte_input(vte, b->data + pos, n);
+    if (++chunks % draw_every == 0) {
+      tsm_screen_draw(screen, draw_cb, NULL);
+      ++*draws;
+    }
+  }
+  tsm_screen_draw(screen, draw_cb, NULL);
+  ++*draws;
+  t = now() - t;
+
+  tsm_vte_unref(vte);
+  tsm_screen_unref(screen);
+  return t;
+}
+
+/* runs in a child so peak RSS is per corpus; allocations are counted for the
+ * first run, every run does the same work */
+static void bench(const char *name, const struct buf *b, int reps) {
+  unsigned long long allocs, frees, bytes;
+  struct rusage ru;
+  long rss_base;
+  unsigned int draws;
+  double t, best;
+  int r;
+
+  getrusage(RUSAGE_SELF, &ru);
+  rss_base = ru.ru_maxrss;
+
+  allocs = mstat.allocs;
+  frees = mstat.frees;
+  bytes = mstat.bytes;
+  best = run(b, &draws);
+  allocs = mstat.allocs - allocs;
+  frees = mstat.frees - frees;
+  bytes = mstat.bytes - bytes;
+
+  for (r = 1; r < reps; r++) {
+    t = run(b, &draws);
+    if (t < best)
+      best = t;
+  }
+
+  getrusage(RUSAGE_SELF, &ru);
+  printf("corpus=%s bytes=%zu reps=%d draws=%u mb_per_s=%.1f ns_per_byte=%.2f "
+         "ms=%.2f peak_rss_kb=%ld rss_delta_kb=%ld allocs=%llu frees=%llu "
+         "alloc_bytes=%llu\n",
+         name, b->len, reps, draws, b->len / best / 1e6, best * 1e9 / b->len,
+         best * 1e3, ru.ru_maxrss, ru.ru_maxrss - rss_base, allocs, frees,
+         bytes);
+}
+
+/* cluster @i: a latin base followed by 1-4 combining diacritical marks */
+static size_t cluster(uint32_t *ch, unsigned int i) {
+  size_t n = 0;
+
+  ch[n++] = 'a' + i % 26;
+  i /= 26;
+  do {
+    ch[n++] = 0x300 + i % 112;
+    i /= 112;
+  } while (i);
+  return n;
+}
+
+static tsm_symbol_t intern(struct tsm_symbol_table *tbl, unsigned int i) {
+  uint32_t ch[8];
+  tsm_symbol_t sym;
+  size_t n, j;
+
+  n = cluster(ch, i);
+  sym = tsm_symbol_make(ch[0]);
+  for (j = 1; j < n; j++)
+    sym = tsm_symbol_append(tbl, sym, ch[j]);
+  return sym;
+}
+
+/* interns BENCH_CLUSTERS distinct clusters, then appends and resolves each of
+ * them again; times are per cluster */
+static void bench_symbols(const char *name, const struct buf *b, int reps) {
+  unsigned long long allocs, sum = 0;
+  struct tsm_symbol_table *tbl;
+  double t, ins = 0, hit = 0, get = 0;
+  struct rusage ru;
+  tsm_symbol_t sym;
+  size_t len;
+  unsigned int i;
+  int r;
+
+  (void)b;
+  allocs = mstat.allocs;
+  for (r = 0; r < reps; r++) {
+    if (tsm_symbol_table_new(&tbl) < 0) {
+      fprintf(stderr, "cannot create symbol table\n");
+      exit(1);
+    }
+
+    t = now();
+    for (i = 0; i < BENCH_CLUSTERS; i++)
+      intern(tbl, i);
+    t = now() - t;
+    if (!r || t < ins)
+      ins = t;
+
+    t = now();
+    for (i = 0; i < BENCH_CLUSTERS; i++)
+      sum += intern(tbl, i);
+    t = now() - t;
+    if (!r || t < hit)
+      hit = t;
+
+    t = now();
+    for (i = 0; i < BENCH_CLUSTERS; i++) {
+      sym = TSM_UCS4_MAX + 2 + i;
+      sum += *tsm_symbol_get(tbl, &sym, &len) + len;
+    }
+    t = now() - t;
+    if (!r || t < get)
+      get = t;
+
+    if (!r)
+      allocs = mstat.allocs - allocs;
+    tsm_symbol_table_unref(tbl);
+  }
+
+  getrusage(RUSAGE_SELF, &ru);
+  printf("corpus=%s clusters=%u reps=%d ns_per_insert=%.1f ns_per_hit=%.1f "
+         "ns_per_get=%.1f peak_rss_kb=%ld allocs=%llu check=%llu\n",
+         name, BENCH_CLUSTERS, reps, ins * 1e9 / BENCH_CLUSTERS,
+         hit * 1e9 / BENCH_CLUSTERS, get * 1e9 / BENCH_CLUSTERS, ru.ru_maxrss,
+         allocs, sum);
+}
+
+static const struct {
+  const char *name;
+  const char *pattern;
+  unsigned int flags;
+} searches[] = {
+  {"literal", "lazy dog", 0},
+  {"icase", "LAZY DOG", TSM_SCREEN_SEARCH_ICASE},
+  {"regex", "qu[a-z]+ (fox|dog)", TSM_SCREEN_SEARCH_REGEX},
+};
+
+/* fills the scroll-back with @b, then searches all of it from scratch for
+ * each pattern; times are per searched line */
+static void bench_search(const char *name, const struct buf *b, int reps) {
+  const struct tsm_screen_match *m;
+  struct tsm_screen *screen;
+  struct tsm_vte *vte;
+  double t, best[3] = { 0 };
+  unsigned int lines, i;
+  size_t num[3] = { 0 };
+  int r;
+
+  if (tsm_screen_new(&screen, NULL, NULL) < 0 ||
+      tsm_vte_new(&vte, screen, write_cb, NULL, NULL, NULL) < 0) {
+    fprintf(stderr, "cannot create screen\n");
+    exit(1);
+  }
+  tsm_screen_set_max_sb(screen, sb_lines);
+  tsm_screen_resize(screen, BENCH_COLS, BENCH_ROWS);
+  tsm_vte_input(vte, b->data, b->len);
+  lines = tsm_screen_sb_get_line_count(screen) + BENCH_ROWS;
+
+  for (r = 0; r < reps; r++) {
+    for (i = 0; i < 3; i++) {
+      t = now();
+      if (tsm_screen_search(screen, searches[i].pattern, searches[i].flags) ||
+          tsm_screen_search_get_matches(screen, &m, &num[i])) {
+        fprintf(stderr, "cannot search\n");
+        exit(1);
+      }
+      t = now() - t;
+      if (!r || t < best[i])
+        best[i] = t;
+    }
+  }
+
+  printf("corpus=%s lines=%u reps=%d", name, lines, reps);
+  for (i = 0; i < 3; i++)
+    printf(" %s_ns_per_line=%.1f %s_matches=%zu", searches[i].name,
+           best[i] * 1e9 / lines, searches[i].name, num[i]);
+  printf("\n");
+
+  tsm_vte_unref(vte);
+  tsm_screen_unref(screen);
+}
+
+static void bench_fork(const char *name, const struct buf *b, int reps,
+                       void (*fn)(const char *, const struct buf *, int)) {
+  int status;
+  pid_t pid;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (!pid) {
+    fn(name, b, reps);
+    fflush(stdout);
+    _exit(0);
+  }
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status)) {
+    fprintf(stderr, "corpus %s failed\n", name);
+    exit(1);
+  }
+}
+
+static void load(struct buf *b, const char *path) {
+  FILE *f;
+  size_t n;
+
+  f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  memset(b, 0, sizeof(*b));
+  do {
+    if (b->cap - b->len < 65536) {
+      b->cap = b->cap ? b->cap * 2 : 1 << 20;
+      b->data = realloc(b->data, b->cap);
+      if (!b->data) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    n = fread(b->data + b->len, 1, b->cap - b->len, f);
+    b->len += n;
+  } while (n);
+  if (ferror(f) || !b->len) {
+    fprintf(stderr, "%s: cannot read corpus\n", path);
+    exit(1);
+  }
+  fclose(f);
+}
+
+int main(int argc, char **argv) {
+  const char *name;
+  struct buf b;
+  int reps = 5;
+  size_t i;
+  int c;
+
+  while ((c = getopt(argc, argv, "r:d:s:m:")) != -1) {
+    switch (c) {
+    case 'r':
+      reps = atoi(optarg);
+      break;
+    case 'd':
+      draw_every = atoi(optarg);
+      break;
+    case 's':
+      sb_lines = strtoul(optarg, NULL, 10);
+      break;
+    case 'm':
+      sb_bytes = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-r reps] [-d chunks-per-draw] [-s sb-lines] "
+              "[-m sb-bytes] [file...]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (reps < 1 || draw_every < 1) {
+    fprintf(stderr, "reps and chunks-per-draw must be positive\n");
+    return 1;
+  }
+
+  if (optind < argc) {
+    for (; optind < argc; optind++) {
+      load(&b, argv[optind]);
+      name = strrchr(argv[optind], '/');
+      bench_fork(name ? name + 1 : argv[optind], &b, reps, bench);
+      free(b.data);
+    }
+    return 0;
+  }
+
+  for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+    memset(&b, 0, sizeof(b));
+    rnd_state = 1;
+    workloads[i].gen(&b);
+    bench_fork(workloads[i].name, &b, reps, bench);
+    free(b.data);
+  }
+  bench_fork("symbols", NULL, reps, bench_symbols);
+
+  memset(&b, 0, sizeof(b));
+  rnd_state = 1;
+  gen_text(&b);
+  bench_fork("search", &b, reps, bench_search);
+  free(b.data);
+
+  return 0;
+}
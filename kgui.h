@@ -158,15 +158,37 @@ static inline void kg_key_process(kg_key_repeat *kr, int *keys, int mod,
  * CLIPBOARD (Linux/xclip)
  * ============================================================================ */
 
-static inline void kg_clipboard_copy(const char *text) {
+/* Stream to write the clipboard contents to; close it with pclose() */
+static inline FILE *kg_clipboard_open_sel(const char *sel) {
+    char cmd[64];
+    if (sel) {
+        snprintf(cmd, sizeof(cmd), "xclip -sel %s", sel);
+    } else {
+        snprintf(cmd, sizeof(cmd), "xclip");
+    }
+    return popen(cmd, "w");
+}
+
+/* Copy @len bytes of @text, which may contain NULs */
+static inline void kg_clipboard_copy_len(const char *text, size_t len,
+                                         const char *sel) {
     if (!text) return;
-    FILE *p = popen("xclip", "w");
+    FILE *p = kg_clipboard_open_sel(sel);
     if (p) {
-        fputs(text, p);
+        fwrite(text, 1, len, p);
         pclose(p);
     }
 }
 
+static inline void kg_clipboard_copy_sel(const char *text, const char *sel) {
+    if (!text) return;
+    kg_clipboard_copy_len(text, strlen(text), sel);
+}
+
+static inline void kg_clipboard_copy(const char *text) {
+    kg_clipboard_copy_sel(text, NULL);
+}
+
 static inline char *kg_clipboard_paste_sel(const char *sel) {
     char cmd[64];
     if (sel) {
@@ -9,7 +9,9 @@
 #include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "tsm/libtsm.h"
@@ -20,6 +22,11 @@
 #define BASE_CHAR_W 9
 #define BASE_CHAR_H 16
 #define BASE_PADDING 2
+/* old scroll-back is stored compressed, about 100 bytes per line; beyond
+ * SCROLLBACK_MEM it goes to a temporary file */
+#define SCROLLBACK_LINES 1000000
+#define SCROLLBACK_FILE_LINES 100000000
+#define SCROLLBACK_MEM (16 << 20)
 
 static kg_ctx ctx;
 static int char_w = 9;
@@ -33,6 +40,7 @@ static pid_t child_pid = -1;
 static int quit_requested = 0;
 static int64_t last_draw = 0;
 static int needs_redraw = 1;
+static int needs_full_redraw = 1;
 static int cols = 80, rows = 24;
 
 static struct tsm_screen *screen = NULL;
@@ -41,7 +49,6 @@ static struct tsm_vte *vte = NULL;
 /* Mouse selection state */
 static int mouse_pressed = 0;
 static int selection_active = 0;
-static char *clipboard_text = NULL;
 static int idle_frames = 0;
 
 static uint32_t palette[TSM_COLOR_NUM] = {
@@ -87,12 +94,243 @@ static uint8_t vte_palette[TSM_COLOR_NUM][3] = {
   [TSM_COLOR_BACKGROUND]    = { 0xff, 0xff, 0xff },
 };
 
+/*
+ * Output queue for the pty. Keyboard input, pastes and VTE replies are
+ * appended to a list of blocks and flushed with writev() from the main loop.
+ * If the pty is full (EAGAIN) the rest stays queued and select() waits for the
+ * fd to become writable again. The pty is always read, otherwise an
+ * application blocked on writing its output would never read the queued input.
+ * Instead, VTE replies are dropped while more than OUTQ_HIGH bytes are pending
+ * so the application cannot make us queue more replies than it consumes; user
+ * input is never dropped.
+ */
+#define OUTQ_BLOCK 4096
+#define OUTQ_IOV 16
+#define OUTQ_HIGH (256 * 1024)
+
+struct outq_block {
+  struct outq_block *next;
+  size_t start;
+  size_t end;
+  char data[OUTQ_BLOCK];
+};
+
+static struct {
+  struct outq_block *head;
+  struct outq_block *tail;
+  struct outq_block *spare;
+  size_t pending;           /* bytes currently queued */
+  uint64_t bytes_queued;    /* total bytes ever queued */
+  uint64_t bytes_flushed;   /* total bytes written to the pty */
+  uint64_t writev_calls;
+  uint64_t eagain;
+  uint64_t replies_dropped; /* VTE reply bytes dropped above OUTQ_HIGH */
+  uint64_t nomem_dropped;   /* bytes lost because no block was allocated */
+  int user;                 /* writes come from keyboard input */
+} outq;
+
+static struct outq_block *outq_block_new(void) {
+  struct outq_block *b = outq.spare;
+
+  if (b) {
+    outq.spare = NULL;
+  } else {
+    b = malloc(sizeof(*b));
+    if (!b) return NULL;
+  }
+  b->next = NULL;
+  b->start = 0;
+  b->end = 0;
+  return b;
+}
+
+static void outq_block_free(struct outq_block *b) {
+  if (!outq.spare) {
+    outq.spare = b;
+  } else {
+    free(b);
+  }
+}
+
+static void outq_push(const char *data, size_t len) {
+  while (len > 0) {
+    struct outq_block *b = outq.tail;
+    if (!b || b->end == OUTQ_BLOCK) {
+      b = outq_block_new();
+      if (!b) {
+        outq.nomem_dropped += len;
+        fprintf(stderr, "kterm: out of memory, dropped %zu bytes of input\n",
+                len);
+        return;
+      }
+      if (outq.tail) {
+        outq.tail->next = b;
+      } else {
+        outq.head = b;
+      }
+      outq.tail = b;
+    }
+
+    size_t n = OUTQ_BLOCK - b->end;
+    if (n > len) n = len;
+    memcpy(b->data + b->end, data, n);
+    b->end += n;
+    data += n;
+    len -= n;
+    outq.pending += n;
+    outq.bytes_queued += n;
+  }
+}
+
+/* Write as much of the queue as the pty accepts. Returns -1 on write errors
+ * other than EAGAIN, 0 otherwise. */
+static int outq_flush(void) {
+  while (outq.head && master_fd >= 0) {
+    struct iovec iov[OUTQ_IOV];
+    int cnt = 0;
+
+    for (struct outq_block *b = outq.head; b && cnt < OUTQ_IOV; b = b->next) {
+      iov[cnt].iov_base = b->data + b->start;
+      iov[cnt].iov_len = b->end - b->start;
+      cnt++;
+    }
+
+    ssize_t n = writev(master_fd, iov, cnt);
+    outq.writev_calls++;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        outq.eagain++;
+        return 0;
+      }
+      return -1;
+    }
+
+    outq.pending -= n;
+    outq.bytes_flushed += n;
+    while (n > 0) {
+      struct outq_block *b = outq.head;
+      size_t left = b->end - b->start;
+      if ((size_t)n < left) {
+        b->start += n;
+        break;
+      }
+      n -= left;
+      outq.head = b->next;
+      if (!outq.head) outq.tail = NULL;
+      outq_block_free(b);
+    }
+  }
+  return 0;
+}
+
+static void outq_clear(void) {
+  while (outq.head) {
+    struct outq_block *b = outq.head;
+    outq.head = b->next;
+    free(b);
+  }
+  outq.tail = NULL;
+  outq.pending = 0;
+  free(outq.spare);
+  outq.spare = NULL;
+}
+
 static void vte_write_cb(struct tsm_vte *vte, const char *u8, size_t len, void *data) {
   (void)vte;
   (void)data;
-  if (master_fd >= 0) {
-    write(master_fd, u8, len);
+  if (!outq.user && outq.pending >= OUTQ_HIGH) {
+    outq.replies_dropped += len;
+    return;
   }
+  outq_push(u8, len);
+}
+
+/* OSC 52 clipboard writes: "52;<sel>;<base64>", decoded as the chunks come
+ * in so large copies never sit in memory twice. Queries ("?") are ignored;
+ * programs must not be able to read the clipboard. */
+#define OSC52_MAX (8 * 1024 * 1024)
+
+static struct {
+  int active;
+  const char *sel;
+  uint32_t acc;
+  int bits;
+  char *data;
+  size_t len, cap;
+  int overflow;
+} osc52;
+
+static int b64_value(char c) {
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+static void osc52_decode(const char *s, size_t len) {
+  size_t i;
+  int v;
+
+  for (i = 0; i < len && !osc52.overflow; i++) {
+    v = b64_value(s[i]);
+    if (v < 0) continue;
+    osc52.acc = osc52.acc << 6 | v;
+    osc52.bits += 6;
+    if (osc52.bits < 8) continue;
+    osc52.bits -= 8;
+    if (osc52.len + 1 >= osc52.cap) {
+      size_t cap = osc52.cap ? osc52.cap * 2 : 4096;
+      char *tmp;
+      if (cap > OSC52_MAX) {
+        osc52.overflow = 1;
+        break;
+      }
+      tmp = realloc(osc52.data, cap);
+      if (!tmp) {
+        osc52.overflow = 1;
+        break;
+      }
+      osc52.data = tmp;
+      osc52.cap = cap;
+    }
+    osc52.data[osc52.len++] = osc52.acc >> osc52.bits;
+  }
+}
+
+static void osc52_begin(const char *u8, size_t len) {
+  const char *end = u8 + len, *p;
+
+  if (len < 3 || memcmp(u8, "52;", 3)) return;
+  p = memchr(u8 + 3, ';', len - 3);
+  if (!p || (end - p == 2 && p[1] == '?')) return;
+
+  memset(&osc52, 0, sizeof(osc52));
+  osc52.active = 1;
+  /* "c" is the clipboard, everything else (default "s0") goes to primary */
+  osc52.sel = memchr(u8 + 3, 'c', p - (u8 + 3)) ? "clipboard" : NULL;
+  osc52_decode(p + 1, end - p - 1);
+}
+
+static void osc52_end(void) {
+  if (!osc52.overflow && osc52.len) {
+    kg_clipboard_copy_len(osc52.data, osc52.len, osc52.sel);
+  } else if (osc52.overflow) {
+    fprintf(stderr, "kterm: OSC 52 payload too large, ignored\n");
+  }
+  free(osc52.data);
+  memset(&osc52, 0, sizeof(osc52));
+}
+
+static void vte_osc_cb(struct tsm_vte *vte, const char *u8, size_t len,
+                       unsigned int flags, void *data) {
+  (void)vte;
+  (void)data;
+  if (flags & TSM_VTE_OSC_BEGIN) osc52_begin(u8, len);
+  else if (osc52.active) osc52_decode(u8, len);
+  if ((flags & TSM_VTE_OSC_END) && osc52.active) osc52_end();
 }
 
 static void pixel_to_cell(struct fenster *f, int px, int py, int *cx, int *cy) {
@@ -105,6 +343,36 @@ static void pixel_to_cell(struct fenster *f, int px, int py, int *cx, int *cy) {
   if (*cy >= rows) *cy = rows - 1;
 }
 
+/* selections and history are streamed out, never held as one string */
+static int export_to_file(struct tsm_screen *con, const char *u8, size_t len,
+                          void *data) {
+  (void)con;
+  return fwrite(u8, 1, len, data) == len ? 0 : -EIO;
+}
+
+/* Ctrl+Shift+S: write scroll-back and screen to $HOME/kterm-history-*.txt */
+static void save_history(void) {
+  const char *dir = getenv("HOME");
+  char path[4096], stamp[32];
+  time_t now = time(NULL);
+  int fd, ret;
+
+  if (!dir || !*dir) dir = "/tmp";
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+  snprintf(path, sizeof(path), "%s/kterm-history-%s.txt", dir, stamp);
+  fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "kterm: cannot create %s: %s\n", path, strerror(errno));
+    return;
+  }
+  ret = tsm_screen_history_write(screen, fd);
+  if (close(fd) && !ret) ret = -errno;
+  if (ret)
+    fprintf(stderr, "kterm: cannot write %s: %s\n", path, strerror(-ret));
+  else
+    fprintf(stderr, "kterm: history saved to %s\n", path);
+}
+
 static void handle_mouse(void) {
   int cx, cy;
   pixel_to_cell(ctx.f, ctx.mouse_x, ctx.mouse_y, &cx, &cy);
@@ -124,11 +392,10 @@ static void handle_mouse(void) {
     /* Mouse button released - copy selection */
     mouse_pressed = 0;
     if (selection_active) {
-      char *sel = NULL;
-      if (tsm_screen_selection_copy(screen, &sel) >= 0 && sel) {
-        kg_clipboard_copy(sel);
-        free(clipboard_text);
-        clipboard_text = sel;
+      FILE *p = kg_clipboard_open_sel(NULL);
+      if (p) {
+        tsm_screen_selection_export(screen, export_to_file, p);
+        pclose(p);
       }
     }
   }
@@ -179,42 +446,81 @@ static char box_to_ascii(uint32_t c) {
   return 0;
 }
 
-static int draw_cb(struct tsm_screen *con, uint64_t id, const uint32_t *ch,
-                   size_t len, unsigned int width, unsigned int posx,
-                   unsigned int posy, const struct tsm_screen_attr *attr,
-                   tsm_age_t age, void *data) {
+/*
+ * The framebuffer keeps the last frame. Scrolls reported by tsm are applied to
+ * it with memmove() and only the damaged cells are painted again, one run of
+ * cells at a time.
+ */
+static unsigned long long draw_frames, draw_full, draw_scrolls, draw_cells;
+
+static void scroll_rows(const struct tsm_screen_scroll *sc) {
+  struct fenster *f = ctx.f;
+  unsigned int height = sc->bottom - sc->top + 1;
+  unsigned int n = sc->delta < 0 ? -sc->delta : sc->delta;
+  size_t row = (size_t)char_h * f->width;
+  uint32_t *top = f->buf + (size_t)(padding + sc->top * char_h) * f->width;
+
+  /* rows scrolled in are damaged and painted anyway */
+  if (n == 0 || n >= height) return;
+  if (sc->delta > 0)
+    memmove(top, top + n * row, (height - n) * row * sizeof(*top));
+  else
+    memmove(top + n * row, top, (height - n) * row * sizeof(*top));
+  draw_scrolls++;
+}
+
+static void draw_glyph(struct fenster *f, int x, int y, uint32_t c,
+                       uint32_t fg) {
+  char tmp[2] = { box_to_ascii(c), 0 };
+
+  if (!tmp[0] && c > 32 && c < 127) tmp[0] = (char)c;
+  if (tmp[0]) fenster_text(f, terminus, x, y, tmp, ctx.scale.font_scale, fg);
+}
+
+/*
+ * Called once per run of cells sharing the same attributes. Search matches,
+ * the selection and the cursor come as separate runs after the text; matches
+ * are highlighted, the other overlays swap the colors.
+ */
+static int draw_cb(struct tsm_screen *con, const uint32_t *ch, size_t len,
+                   unsigned int cells, unsigned int posx, unsigned int posy,
+                   const struct tsm_screen_attr *attr, unsigned int flags,
+                   void *data) {
   (void)con;
-  (void)id;
-  (void)width;
-  (void)age;
   (void)data;
 
   struct fenster *f = ctx.f;
   int x = padding + posx * char_w;
   int y = padding + posy * char_h;
+  int inverse = attr->inverse;
+
+  if (flags & (TSM_SCREEN_RUN_SELECTED | TSM_SCREEN_RUN_CURSOR))
+    inverse = !inverse;
 
   uint32_t fg = attr_to_color(attr, 1);
   uint32_t bg = attr_to_color(attr, 0);
 
-  if (attr->inverse) {
+  if (flags & TSM_SCREEN_RUN_MATCH) {
+    fg = palette[TSM_COLOR_BLACK];
+    bg = palette[TSM_COLOR_LIGHT_YELLOW];
+    inverse = 0;
+  }
+
+  if (inverse) {
     uint32_t tmp = fg;
     fg = bg;
     bg = tmp;
   }
 
-  fenster_rect(f, x, y, char_w, char_h, bg);
+  fenster_rect(f, x, y, cells * char_w, char_h, bg);
+  draw_cells += cells;
 
-  if (len > 0) {
-    uint32_t c = ch[0];
-    char ascii = box_to_ascii(c);
-    if (ascii) {
-      char tmp[2] = { ascii, 0 };
-      fenster_text(f, terminus, x, y, tmp, ctx.scale.font_scale, fg);
-    } else if (c > 32 && c < 127) {
-      char tmp[2] = { (char)c, 0 };
-      fenster_text(f, terminus, x, y, tmp, ctx.scale.font_scale, fg);
-    }
+  if (flags & TSM_SCREEN_RUN_COMBINED) {
+    if (len > 0) draw_glyph(f, x, y, ch[0], fg);
+    return 0;
   }
+  for (size_t i = 0; i < len; i++)
+    draw_glyph(f, x + i * char_w, y, ch[i], fg);
 
   return 0;
 }
@@ -308,6 +614,137 @@ static void cancel_selection(void) {
   }
 }
 
+/*
+ * Find prompt (Ctrl+Shift+F). Every key re-runs the search, which is
+ * case-insensitive unless the pattern has an upper-case letter; Tab toggles
+ * regular expressions. Enter jumps to the next older match, Shift+Enter to
+ * the next newer one and Escape closes the prompt.
+ */
+static struct {
+  int open;
+  int regex;
+  int error;
+  char pattern[256];
+  size_t len;
+  int have_cur;
+  struct tsm_screen_match cur;
+} find;
+
+static int match_cmp(const struct tsm_screen_match *a,
+                     const struct tsm_screen_match *b) {
+  if (a->id != b->id) return a->id < b->id ? -1 : 1;
+  if (a->x != b->x) return a->x < b->x ? -1 : 1;
+  return 0;
+}
+
+/* move to the next older (dir < 0) or newer match, wrapping around */
+static void find_step(int dir) {
+  const struct tsm_screen_match *m;
+  size_t num, i;
+
+  if (tsm_screen_search_get_matches(screen, &m, &num) || !num) {
+    find.have_cur = 0;
+    return;
+  }
+
+  if (!find.have_cur) {
+    i = num - 1;
+  } else if (dir < 0) {
+    for (i = num; i > 0 && match_cmp(&m[i - 1], &find.cur) >= 0; i--);
+    i = i ? i - 1 : num - 1;
+  } else {
+    for (i = 0; i < num && match_cmp(&m[i], &find.cur) <= 0; i++);
+    if (i == num) i = 0;
+  }
+
+  find.cur = m[i];
+  find.have_cur = 1;
+  tsm_screen_sb_show(screen, find.cur.id);
+}
+
+static void find_update(void) {
+  unsigned int flags = 0;
+  int ret;
+
+  find.pattern[find.len] = 0;
+  if (find.regex) flags |= TSM_SCREEN_SEARCH_REGEX;
+  flags |= TSM_SCREEN_SEARCH_ICASE;
+  for (size_t i = 0; i < find.len; i++)
+    if (find.pattern[i] >= 'A' && find.pattern[i] <= 'Z')
+      flags &= ~TSM_SCREEN_SEARCH_ICASE;
+
+  ret = tsm_screen_search(screen, find.pattern, flags);
+  find.error = ret == -EINVAL;
+  find.have_cur = 0;
+  if (!ret && find.len) find_step(-1);
+  needs_redraw = 1;
+}
+
+static void find_close(void) {
+  find.open = 0;
+  find.len = 0;
+  find.have_cur = 0;
+  tsm_screen_search(screen, NULL, 0);
+  tsm_screen_sb_reset(screen);
+  needs_redraw = 1;
+  needs_full_redraw = 1;
+}
+
+static void find_key(int k, int shift) {
+  uint32_t c;
+
+  switch (k) {
+    case KG_KEY_ESCAPE:
+      find_close();
+      return;
+    case KG_KEY_RETURN:
+      find_step(shift ? 1 : -1);
+      needs_redraw = 1;
+      return;
+    case KG_KEY_BACKSPACE:
+      if (find.len) find.len--;
+      find_update();
+      return;
+    case KG_KEY_TAB:
+      find.regex = !find.regex;
+      find_update();
+      return;
+  }
+
+  c = get_unicode(k, shift);
+  if (c && find.len + 1 < sizeof(find.pattern)) {
+    find.pattern[find.len++] = (char)c;
+    find_update();
+  }
+}
+
+/* the prompt covers the bottom row, which is repainted once it closes;
+ * draw() keeps scrolls from moving it */
+static void draw_find(void) {
+  struct fenster *f = ctx.f;
+  const struct tsm_screen_match *m;
+  char line[512], status[64];
+  size_t num = 0, i = 0;
+  int y = padding + (rows - 1) * char_h;
+
+  if (find.error) {
+    snprintf(status, sizeof(status), "bad regex");
+  } else if (tsm_screen_search_get_matches(screen, &m, &num) || !num) {
+    snprintf(status, sizeof(status), find.len ? "no matches" : "");
+  } else {
+    if (find.have_cur)
+      while (i < num && match_cmp(&m[i], &find.cur) < 0) i++;
+    snprintf(status, sizeof(status), "%zu/%zu", num - i, num);
+  }
+
+  snprintf(line, sizeof(line), "%s: %.*s_  %s", find.regex ? "regex" : "find",
+           (int)find.len, find.pattern, status);
+  fenster_rect(f, padding, y, cols * char_w, char_h,
+               palette[TSM_COLOR_LIGHT_GREY]);
+  fenster_text(f, terminus, padding, y, line, ctx.scale.font_scale,
+               palette[TSM_COLOR_BLACK]);
+}
+
 static void handle_key(int k, int mod, void *userdata) {
   (void)userdata;
   int ctrl = mod & KG_MOD_CTRL;
@@ -318,16 +755,37 @@ static void handle_key(int k, int mod, void *userdata) {
     return;
   }
 
+  /* Find with Ctrl+Shift+F */
+  if (ctrl && shift && (k == 'F' || k == 'f')) {
+    if (find.open) {
+      find_close();
+    } else {
+      find.open = 1;
+      needs_redraw = 1;
+    }
+    return;
+  }
+  if (find.open && !ctrl) {
+    find_key(k, shift);
+    return;
+  }
+
   /* Paste with Ctrl+Shift+V */
   if (ctrl && shift && (k == 'V' || k == 'v')) {
     char *paste = kg_clipboard_paste();
     if (paste) {
-      write(master_fd, paste, strlen(paste));
+      outq_push(paste, strlen(paste));
       free(paste);
     }
     return;
   }
 
+  /* Save history with Ctrl+Shift+S */
+  if (ctrl && shift && (k == 'S' || k == 's')) {
+    save_history();
+    return;
+  }
+
   /* Scrollback navigation with shift+arrows */
   if (shift && k == KG_KEY_UP) {
     tsm_screen_sb_up(screen, 1);
@@ -359,7 +817,9 @@ static void handle_key(int k, int mod, void *userdata) {
   if (ctrl) mods |= TSM_CONTROL_MASK;
   if (shift) mods |= TSM_SHIFT_MASK;
 
+  outq.user = 1;
   tsm_vte_handle_keyboard(vte, keysym, keysym, mods, unicode);
+  outq.user = 0;
 }
 
 static void handle_resize(void) {
@@ -369,6 +829,7 @@ static void handle_resize(void) {
 
   if (f->size_changed) {
     needs_redraw = 1;
+    needs_full_redraw = 1;
   }
 
   if (new_cols != cols || new_rows != rows) {
@@ -382,14 +843,62 @@ static void handle_resize(void) {
   }
 }
 
+/* Synchronized output (DEC mode 2026): while an app is drawing a frame the
+ * redraw waits until it is done, but never longer than SYNC_TIMEOUT ms so a
+ * crashed or misbehaving app cannot freeze the window. */
+#define SYNC_TIMEOUT 150
+
+static int64_t sync_start = 0;
+static unsigned long long sync_held = 0, sync_timeouts = 0;
+
+static int sync_hold(void) {
+  int64_t now;
+
+  if (!(tsm_screen_get_flags(screen) & TSM_SCREEN_SYNC_UPDATE)) {
+    sync_start = 0;
+    return 0;
+  }
+  now = fenster_time();
+  if (!sync_start) sync_start = now;
+  if (now - sync_start < SYNC_TIMEOUT) {
+    sync_held++;
+    return 1;
+  }
+  sync_timeouts++;
+  sync_start = now;
+  return 0;
+}
+
 static void draw(void) {
   struct fenster *f = ctx.f;
-  int w = f->width;
-  int h = f->height;
+  struct tsm_screen_scroll sc;
 
-  for (int i = 0; i < w * h; i++) f->buf[i] = default_bg;
+  draw_frames++;
+  if (needs_full_redraw) {
+    int w = f->width;
+    int h = f->height;
 
-  tsm_screen_draw(screen, draw_cb, NULL);
+    for (int i = 0; i < w * h; i++) f->buf[i] = default_bg;
+    tsm_screen_damage_all(screen);
+    needs_full_redraw = 0;
+    draw_full++;
+  } else {
+    /* moving rows up would copy the find prompt over the row above it, and
+     * only the rows scrolled in are damaged; repaint everything instead */
+    for (unsigned int i = 0; find.open &&
+         !tsm_screen_get_scroll(screen, i, &sc); i++) {
+      if (sc.bottom == (unsigned int)rows - 1 && sc.delta > 0) {
+        tsm_screen_damage_all(screen);
+        break;
+      }
+    }
+    for (unsigned int i = 0; !tsm_screen_get_scroll(screen, i, &sc); i++)
+      scroll_rows(&sc);
+  }
+
+  tsm_screen_draw_runs(screen, draw_cb, NULL);
+  tsm_screen_clear_damage(screen);
+  if (find.open) draw_find();
 }
 
 static int run(void) {
@@ -421,7 +930,10 @@ static int run(void) {
   tsm_screen_set_def_attr(screen, &def_attr);
 
   tsm_screen_resize(screen, cols, rows);
-  tsm_screen_set_max_sb(screen, 5000);
+  if (tsm_screen_set_sb_budget(screen, SCROLLBACK_MEM) == 0)
+    tsm_screen_set_max_sb(screen, SCROLLBACK_FILE_LINES);
+  else
+    tsm_screen_set_max_sb(screen, SCROLLBACK_LINES);
 
   /* Initialize TSM VTE */
   if (tsm_vte_new(&vte, screen, vte_write_cb, NULL, NULL, NULL) < 0) {
@@ -430,6 +942,7 @@ static int run(void) {
     return 1;
   }
   tsm_vte_set_custom_palette(vte, vte_palette);
+  tsm_vte_set_osc_chunk_cb(vte, vte_osc_cb, NULL);
   tsm_vte_set_palette(vte, "custom");
   tsm_vte_set_backspace_sends_delete(vte, true);
 
@@ -448,15 +961,25 @@ static int run(void) {
     /* Process keyboard before blocking on select */
     kg_key_process(&ctx.key_repeat, f.keys, f.mod, handle_key, NULL);
 
+    /* Send keystrokes right away; whatever the pty does not take now is
+     * retried once select() reports it writable */
+    if (outq_flush() < 0) break;
+
     /* Use longer timeout when idle to reduce CPU usage */
-    fd_set fds;
+    fd_set fds, wfds;
     int timeout_us = (idle_frames > 30) ? 50000 : 16000;  /* 100ms idle, 16ms active */
     struct timeval tv = { .tv_sec = 0, .tv_usec = timeout_us };
     FD_ZERO(&fds);
+    FD_ZERO(&wfds);
     FD_SET(master_fd, &fds);
+    if (outq.pending > 0) FD_SET(master_fd, &wfds);
 
     int had_activity = 0;
-    if (select(master_fd + 1, &fds, NULL, NULL, &tv) > 0) {
+    int ready = select(master_fd + 1, &fds, &wfds, NULL, &tv);
+    if (ready > 0 && FD_ISSET(master_fd, &wfds)) {
+      if (outq_flush() < 0) break;
+    }
+    if (ready > 0 && FD_ISSET(master_fd, &fds)) {
       char rd[4096];
       ssize_t n;
       while ((n = read(master_fd, rd, sizeof(rd))) > 0) {
@@ -499,7 +1022,7 @@ static int run(void) {
       needs_redraw = 1;
     }
 
-    if (needs_redraw) {
+    if (needs_redraw && !sync_hold()) {
       draw();
       f.dirty = true;
       needs_redraw = 0;
@@ -507,9 +1030,35 @@ static int run(void) {
     }
   }
 
+  if (getenv("KTERM_STATS")) {
+    fprintf(stderr, "outq: queued %llu flushed %llu pending %zu writev %llu eagain %llu "
+            "replies dropped %llu nomem dropped %llu\n",
+            (unsigned long long)outq.bytes_queued,
+            (unsigned long long)outq.bytes_flushed, outq.pending,
+            (unsigned long long)outq.writev_calls,
+            (unsigned long long)outq.eagain,
+            (unsigned long long)outq.replies_dropped,
+            (unsigned long long)outq.nomem_dropped);
+    fprintf(stderr, "sync: held %llu frames, %llu timeouts\n", sync_held,
+            sync_timeouts);
+    fprintf(stderr, "draw: %llu frames, %llu full, %llu scrolls, %llu cells\n",
+            draw_frames, draw_full, draw_scrolls, draw_cells);
+    uint64_t pool_hits, pool_misses;
+    tsm_screen_get_line_pool_stats(screen, &pool_hits, &pool_misses);
+    fprintf(stderr, "lines: pool hits %llu misses %llu\n",
+            (unsigned long long)pool_hits, (unsigned long long)pool_misses);
+    unsigned int sym_num;
+    size_t sym_bytes;
+    uint64_t sym_gcs;
+    tsm_screen_get_symbol_stats(screen, &sym_num, &sym_bytes, &sym_gcs);
+    fprintf(stderr, "symbols: %u in %zu bytes, %llu collections\n", sym_num,
+            sym_bytes, (unsigned long long)sym_gcs);
+  }
+
   if (child_pid > 0) { kill(child_pid, SIGHUP); waitpid(child_pid, NULL, 0); }
   if (master_fd >= 0) close(master_fd);
-  free(clipboard_text);
+  outq_clear();
+  free(osc52.data);
   tsm_vte_unref(vte);
   tsm_screen_unref(screen);
   fenster_close(&f);
@@ -0,0 +1,125 @@
+#!/usr/bin/env perl
+# gen-grapheme - generate the grapheme break property table in grapheme.h
+#
+# The Grapheme_Cluster_Break property is taken from the Unicode tables that
+# ship with perl (Unicode::UCD), so no UCD files are needed. The table uses
+# the same two-level layout as wcwidth.h with four bits per code point.
+#
+# usage: perl tsm/gen-grapheme.pl > tsm/grapheme.h
+use strict;
+use warnings;
+use Unicode::UCD qw(prop_invmap);
+
+my $MAX = 0x110000;
+my $BLOCK = 256;
+
+# values must match enum tsm_grapheme below
+my %value = (
+	'Other' => 0,
+	'CR' => 1,
+	'LF' => 2,
+	'Control' => 3,
+	'Extend' => 4,
+	'ZWJ' => 5,
+	'Regional_Indicator' => 6,
+	'Prepend' => 7,
+	'SpacingMark' => 8,
+	'L' => 9,
+	'V' => 10,
+	'T' => 11,
+	'LV' => 12,
+	'LVT' => 13,
+	# perl folds Extended_Pictographic into GCB, it is Other for breaking
+	'ExtPict_XX' => 0,
+);
+
+my ($list, $map) = prop_invmap('GCB');
+my @prop = (0) x $MAX;
+for my $i (0 .. $#$list) {
+	my $end = $i < $#$list ? $list->[$i + 1] : $MAX;
+	my $v = $value{$map->[$i]};
+	die "unknown GCB value $map->[$i]\n" unless defined $v;
+	@prop[$list->[$i] .. $end - 1] = ($v) x ($end - $list->[$i]) if $v;
+}
+
+my (@stage1, @blocks, %index);
+for (my $base = 0; $base < $MAX; $base += $BLOCK) {
+	my $row = '';
+	for (my $i = 0; $i < $BLOCK; $i += 2) {
+		$row .= chr($prop[$base + $i] | $prop[$base + $i + 1] << 4);
+	}
+	unless (exists $index{$row}) {
+		$index{$row} = scalar @blocks;
+		push @blocks, $row;
+	}
+	push @stage1, $index{$row};
+}
+
+my $version = Unicode::UCD::UnicodeVersion();
+print <<"EOF";
+#ifndef GRAPHEME_H
+#define GRAPHEME_H
+
+/*
+ * Generated by gen-grapheme.pl from Unicode $version, do not edit.
+ *
+ * Grapheme_Cluster_Break property of every code point. grapheme_stage1 maps
+ * each block of $BLOCK code points to a row of grapheme_stage2 that stores the
+ * property in four bits per code point.
+ */
+
+#include <stdint.h>
+
+enum tsm_grapheme {
+	TSM_GRAPHEME_OTHER,
+	TSM_GRAPHEME_CR,
+	TSM_GRAPHEME_LF,
+	TSM_GRAPHEME_CONTROL,
+	TSM_GRAPHEME_EXTEND,
+	TSM_GRAPHEME_ZWJ,
+	TSM_GRAPHEME_RI,
+	TSM_GRAPHEME_PREPEND,
+	TSM_GRAPHEME_SPACING_MARK,
+	TSM_GRAPHEME_L,
+	TSM_GRAPHEME_V,
+	TSM_GRAPHEME_T,
+	TSM_GRAPHEME_LV,
+	TSM_GRAPHEME_LVT,
+};
+
+EOF
+
+printf "static const uint8_t grapheme_stage1[%d] = {\n", scalar @stage1;
+for (my $i = 0; $i < @stage1; $i += 16) {
+	my $end = $i + 15 < $#stage1 ? $i + 15 : $#stage1;
+	print "\t", join(', ', @stage1[$i .. $end]), ",\n";
+}
+print "};\n\n";
+
+printf "static const uint8_t grapheme_stage2[%d][%d] = {\n",
+	scalar @blocks, $BLOCK / 2;
+for my $row (@blocks) {
+	my @b = map { ord } split //, $row;
+	print "\t{\n";
+	for (my $i = 0; $i < @b; $i += 16) {
+		print "\t\t", join(', ', map { sprintf '0x%02x', $_ }
+				    @b[$i .. $i + 15]), ",\n";
+	}
+	print "\t},\n";
+}
+print "};\n\n";
+
+printf <<'EOF', $MAX;
+static inline enum tsm_grapheme tsm_grapheme_get(uint32_t ucs4)
+{
+	uint8_t v;
+
+	if (ucs4 >= 0x%x)
+		return TSM_GRAPHEME_OTHER;
+
+	v = grapheme_stage2[grapheme_stage1[ucs4 >> 8]][(ucs4 & 0xff) >> 1];
+	return (v >> ((ucs4 & 1) * 4)) & 0xf;
+}
+
+#endif /* GRAPHEME_H */
+EOF
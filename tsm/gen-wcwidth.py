@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+# gen-wcwidth - generate the two-level width table in wcwidth.h
+#
+# Widths come from the unicodedata module of the running interpreter, so the
+# table follows its Unicode version:
+#   -1  C0/C1 control characters
+#    0  NUL, combining marks (Mn, Me), format characters (Cf) and the Hangul
+#       medial vowels and final consonants
+#    2  East Asian Wide and Fullwidth, which includes every character with
+#       default emoji presentation, and the unassigned planes 2 and 3
+#    1  everything else
+#
+# usage: python3 tsm/gen-wcwidth.py > tsm/wcwidth.h
+import sys
+import unicodedata
+
+MAX = 0x110000
+BLOCK = 256
+
+# prepended concatenation marks are Cf but take a cell
+SPACING_CF = {0xad, 0x600, 0x601, 0x602, 0x603, 0x604, 0x605, 0x6dd, 0x70f,
+              0x890, 0x891, 0x8e2, 0x110bd, 0x110cd}
+
+
+def width(cp):
+    if cp == 0:
+        return 0
+    if cp < 0x20 or 0x7f <= cp < 0xa0:
+        return -1
+    if 0xd800 <= cp <= 0xdfff:
+        return 1
+    ch = chr(cp)
+    cat = unicodedata.category(ch)
+    if cat in ('Mn', 'Me'):
+        return 0
+    if cat == 'Cf' and cp not in SPACING_CF:
+        return 0
+    if 0x1160 <= cp <= 0x11ff or 0xd7b0 <= cp <= 0xd7ff:
+        return 0
+    if 0x20000 <= cp <= 0x2fffd or 0x30000 <= cp <= 0x3fffd:
+        return 2
+    # unassigned code points do not carry a meaningful width
+    if cat == 'Cn':
+        return 1
+    if unicodedata.east_asian_width(ch) in ('W', 'F'):
+        return 2
+    return 1
+
+
+def main():
+    blocks = []
+    index = {}
+    stage1 = []
+    for base in range(0, MAX, BLOCK):
+        packed = bytearray(BLOCK // 4)
+        for i in range(BLOCK):
+            packed[i // 4] |= (width(base + i) + 1) << (i % 4 * 2)
+        packed = bytes(packed)
+        if packed not in index:
+            index[packed] = len(blocks)
+            blocks.append(packed)
+        stage1.append(index[packed])
+
+    out = sys.stdout
+    out.write('#ifndef WCWIDTH_H\n#define WCWIDTH_H\n\n')
+    out.write('/*\n * Generated by gen-wcwidth.py from Unicode %s, do not edit.\n'
+              % unicodedata.unidata_version)
+    out.write(' *\n'
+              ' * Two-level lookup: wcwidth_stage1 maps each block of %d code\n'
+              ' * points to a row of wcwidth_stage2 that stores width + 1 in two\n'
+              ' * bits per code point.\n */\n\n' % BLOCK)
+    out.write('#include <stdint.h>\n#include <wchar.h>\n\n')
+    out.write('/* Map standard wcwidth to our implementation */\n')
+    out.write('#define wcwidth mk_wcwidth\n\n')
+
+    out.write('static const uint8_t wcwidth_stage1[%d] = {\n' % len(stage1))
+    for i in range(0, len(stage1), 16):
+        out.write('\t' + ', '.join('%d' % v for v in stage1[i:i + 16]) +
+                  ',\n')
+    out.write('};\n\n')
+
+    out.write('static const uint8_t wcwidth_stage2[%d][%d] = {\n'
+              % (len(blocks), BLOCK // 4))
+    for b in blocks:
+        out.write('\t{\n')
+        for i in range(0, len(b), 16):
+            out.write('\t\t' + ', '.join('0x%02x' % v for v in b[i:i + 16]) +
+                      ',\n')
+        out.write('\t},\n')
+    out.write('};\n\n')
+
+    out.write('''static inline int mk_wcwidth(wchar_t ucs) {
+  uint32_t c = ucs;
+
+  if (c >= 0x20 && c < 0x7f) return 1;
+  if (c >= 0x%x) return 1;
+  c = wcwidth_stage2[wcwidth_stage1[c >> 8]][(c & 0xff) >> 2];
+  return (int)((c >> ((ucs & 3) * 2)) & 3) - 1;
+}
+
+static inline int mk_wcswidth(const wchar_t *pwcs, size_t n) {
+  int w, width = 0;
+  for (;*pwcs && n-- > 0; pwcs++) {
+    if ((w = mk_wcwidth(*pwcs)) < 0) return -1;
+    width += w;
+  }
+  return width;
+}
+
+#endif /* WCWIDTH_H */
+''' % MAX)
+
+
+if __name__ == '__main__':
+    main()
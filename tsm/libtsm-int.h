@@ -57,6 +57,13 @@ const uint32_t *tsm_symbol_get(struct tsm_symbol_table *tbl,
 unsigned int tsm_symbol_get_width(struct tsm_symbol_table *tbl,
 				  tsm_symbol_t sym);
 
+/* index of a composed symbol; maps passed to the collector are indexed so */
+#define TSM_SYMBOL_INDEX(sym) ((sym) - (TSM_UCS4_MAX + 1))
+
+void tsm_symbol_table_get_stats(struct tsm_symbol_table *tbl,
+				unsigned int *num, size_t *bytes);
+int tsm_symbol_table_collect(struct tsm_symbol_table *tbl, uint32_t *map);
+
 /* utf8 state machine */
 
 struct tsm_utf8_mach;
@@ -76,26 +83,84 @@ void tsm_utf8_mach_free(struct tsm_utf8_mach *mach);
 int tsm_utf8_mach_feed(struct tsm_utf8_mach *mach, char c);
 uint32_t tsm_utf8_mach_get(struct tsm_utf8_mach *mach);
 void tsm_utf8_mach_reset(struct tsm_utf8_mach *mach);
+bool tsm_utf8_mach_is_idle(struct tsm_utf8_mach *mach);
+size_t tsm_utf8_mach_decode(struct tsm_utf8_mach *mach, const char *in,
+			    size_t len, uint32_t *out);
 
 /* TSM screen */
 
+/* Cells are kept small as there are a lot of them in the scroll-back buffer.
+ * Attributes are interned into the per-screen attribute table and cells only
+ * store the id. Ages are 32bit; the screen age counter wraps accordingly.
+ * Ids are 16bit, so at most TSM_ATTR_MAX distinct attributes are in use at a
+ * time. Once they are, unused ids are collected and scroll-back lines are
+ * compressed, which stores their attributes by value. Only if the screen, the
+ * newest scroll-back chunk and a chunk being decompressed still need more ids,
+ * cells fall back to the default attributes; this is logged. */
+#define TSM_ATTR_MAX 65536
+
 struct cell {
 	tsm_symbol_t ch;		/* stored character */
-	unsigned int width;		/* character width */
-	struct tsm_screen_attr attr;	/* cell attributes */
-	tsm_age_t age;			/* age of the single cell */
+	uint16_t attr;			/* id in the attribute table */
+	uint8_t width;			/* character width */
+	uint32_t age;			/* age of the single cell */
 };
 
 struct line {
-	struct line *next;		/* next line (NULL if not sb) */
-	struct line *prev;		/* prev line (NULL if not sb) */
-
 	unsigned int size;		/* real width */
+	unsigned int cap;		/* allocated cells */
 	struct cell *cells;		/* actuall cells */
 	uint64_t sb_id;			/* sb ID */
 	tsm_age_t age;			/* age of the whole line */
+	uint16_t fill;			/* attr of the blank cells past size */
+};
+
+/* Scroll-back lines are stored in chunks of SB_CHUNK_LEN line pointers. The
+ * chunks form a ring indexed by sb_id, so every line is found in O(1) and the
+ * oldest chunk is dropped as a whole once all its lines are gone.
+ * Only the newest SB_HOT_CHUNKS chunks keep their lines as cells. Older ones
+ * are compressed and only decompressed again when a line is accessed; at most
+ * SB_THAWED_MAX of them are kept decompressed, the least recently used one is
+ * dropped first. With a memory budget, compressed chunks beyond it are moved to
+ * a temporary file, oldest first, and mapped again when they are accessed. */
+#define SB_CHUNK_SHIFT 8
+#define SB_CHUNK_LEN (1U << SB_CHUNK_SHIFT)
+#define SB_CHUNK_MASK (SB_CHUNK_LEN - 1)
+#define SB_HOT_CHUNKS 3
+#define SB_THAWED_MAX 8
+
+struct sb_chunk {
+	struct line **lines;		/* lines; NULL while compressed */
+	uint8_t *data;			/* compressed lines or NULL */
+	size_t data_len;		/* size of the compressed lines */
+	uint64_t file_off;		/* offset in sb_fd if spilled */
+	uint32_t used;			/* sb_tick of the last access */
+	bool spilled;			/* compressed lines are in sb_fd */
 };
 
+/* Composed symbols are collected once their number reaches twice the number
+ * that survived the last collection, but never below SYM_GC_MIN. */
+#define SYM_GC_MIN 4096
+
+/* max number of unused lines kept for reuse */
+#define LINE_POOL_MAX 64
+
+/* Lines shorter than the screen, i.e. trimmed and decompressed scroll-back
+ * lines, are allocated in size classes of LINE_CLASS_CELLS cells. Up to
+ * LINE_CLASS_MAX unused ones are kept, enough for a whole chunk of lines. */
+#define LINE_CLASS_CELLS 8
+#define LINE_CLASS_NUM 64
+#define LINE_CLASS_MAX SB_CHUNK_LEN
+
+/* damaged columns [start, end) of a screen row */
+struct damage {
+	unsigned int start;
+	unsigned int end;
+};
+
+/* max number of scrolls recorded between two tsm_screen_clear_damage() */
+#define DAMAGE_SCROLL_MAX 8
+
 #define SELECTION_TOP -1
 struct selection_pos {
 	struct line *line;
@@ -119,6 +184,22 @@ struct tsm_screen {
 	 * screen with these attributes and not the ones of the alt screen */
 	struct tsm_screen_attr def_attr_main;
 
+	/* interned cell attributes */
+	struct tsm_screen_attr *attrs;	/* attributes by id */
+	unsigned int attr_num;		/* number of ids in use */
+	unsigned int attr_size;		/* allocated entries of attrs */
+	uint32_t *attr_hash;		/* open-addressing table of id + 1 */
+	unsigned int attr_hash_size;	/* number of slots; power of two */
+	uint16_t attr_last;		/* id of the last interned attribute */
+	uint16_t def_attr_id;		/* id of def_attr */
+	unsigned int attr_gc_wait;	/* misses before collecting again */
+	unsigned int attr_gc_count;	/* number of collections so far */
+	unsigned int attr_fallbacks;	/* defaults handed out since last log */
+
+	/* composed symbols */
+	unsigned int sym_gc_next;	/* collect at this many symbols */
+	uint64_t sym_gc_count;		/* number of collections so far */
+
 	/* ageing */
 	tsm_age_t age_cnt;		/* current age counter */
 	unsigned int age_reset : 1;	/* age-overflow flag */
@@ -134,13 +215,38 @@ struct tsm_screen {
 	struct line **alt_lines;	/* real alternative lines */
 	tsm_age_t age;			/* whole screen age */
 
+	/* unused lines kept for reuse */
+	struct line *line_pool[LINE_POOL_MAX];
+	unsigned int line_pool_num;
+	struct line *line_class[LINE_CLASS_NUM];	/* short lines by size
+							 * class, chained
+							 * through ->cells */
+	unsigned int line_class_num;	/* lines in line_class */
+	uint64_t line_pool_hits;	/* lines taken from a pool */
+	uint64_t line_pool_misses;	/* lines that had to be allocated */
+
 	/* scroll-back buffer */
+	struct sb_chunk *sb_chunks;	/* ring of chunks, indexed by sb_id */
+	unsigned int sb_chunk_num;	/* size of the ring; power of two */
+	struct line **sb_chunk_spare;	/* last freed line array, for reuse */
+	unsigned int sb_thawed;		/* decompressed chunks */
+	uint32_t sb_tick;		/* access clock of decompressed chunks */
+	uint32_t *sb_attr_map;		/* attr id to chunk index, compression */
+	uint16_t sb_attr_gen;		/* generation of sb_attr_map entries */
+	struct line sb_blank;		/* stand-in if a chunk cannot be read */
+	size_t sb_mem;			/* compressed bytes in memory */
+	size_t sb_mem_max;		/* spill beyond this; 0 never spills */
+	uint64_t sb_spill_id;		/* oldest chunk that may be in memory */
+	int sb_fd;			/* unlinked spill file or -1 */
+	uint64_t sb_file_len;		/* end of the spill file */
+	uint64_t sb_file_hole;		/* spill file is punched up to here */
+	unsigned int sb_spilled;	/* chunks in the spill file */
 	unsigned int sb_count;		/* number of lines in sb */
-	struct line *sb_first;		/* first line; was moved first */
-	struct line *sb_last;		/* last line; was moved last*/
+	uint64_t sb_first_id;		/* id of the oldest sb-line */
 	unsigned int sb_max;		/* max-limit of lines in sb */
-	struct line *sb_pos;		/* current position in sb or NULL */
-	unsigned int sb_pos_num;	/* current numeric position in sb */
+	bool sb_scrolled;		/* view is scrolled into the sb */
+	unsigned int sb_pos_num;	/* first shown sb-line; sb_count if
+					 * not scrolled */
 	uint64_t sb_last_id;		/* last id given to sb-line */
 
 	/* cursor: positions are always in-bound, but cursor_x might be
@@ -148,6 +254,15 @@ struct tsm_screen {
 	unsigned int cursor_x;		/* current cursor x-pos */
 	unsigned int cursor_y;		/* current cursor y-pos */
 
+	/* damage since the last tsm_screen_clear_damage(), in view rows */
+	uint64_t *dmg_rows;		/* bitmap of damaged rows */
+	struct damage *dmg;		/* damaged columns of each row */
+	unsigned int dmg_cur_x;		/* cursor cell at the last clear */
+	unsigned int dmg_cur_y;
+	bool dmg_cur_hidden;		/* cursor was hidden at the last clear */
+	struct tsm_screen_scroll dmg_scrolls[DAMAGE_SCROLL_MAX];
+	unsigned int dmg_scroll_num;	/* recorded scrolls */
+
 	/* tab ruler */
 	bool *tab_ruler;		/* tab-flag for all cells of one row */
 
@@ -155,17 +270,98 @@ struct tsm_screen {
 	bool sel_active;
 	struct selection_pos sel_start;
 	struct selection_pos sel_end;
+
+	/* search, NULL if there is none */
+	struct screen_search *search;
 };
 
 void screen_cell_init(struct tsm_screen *con, struct cell *cell);
+uint16_t screen_attr_intern(struct tsm_screen *con,
+			    const struct tsm_screen_attr *attr);
+
+static inline const struct tsm_screen_attr *
+screen_cell_attr(struct tsm_screen *con, const struct cell *cell)
+{
+	return &con->attrs[cell->attr];
+}
+
+void tsm_screen_write_ascii(struct tsm_screen *con, const char *u8, size_t len,
+			    const struct tsm_screen_attr *attr);
+void tsm_screen_write_repeat(struct tsm_screen *con, tsm_symbol_t ch,
+			     size_t num, const struct tsm_screen_attr *attr);
+tsm_symbol_t tsm_screen_compose(struct tsm_screen *con, uint32_t ucs4);
 
 void tsm_screen_set_opts(struct tsm_screen *scr, unsigned int opts);
 void tsm_screen_reset_opts(struct tsm_screen *scr, unsigned int opts);
 unsigned int tsm_screen_get_opts(struct tsm_screen *scr);
 
+struct line *screen_sb_thaw(struct tsm_screen *con, uint64_t id);
+
+void screen_search_free(struct tsm_screen *con);
+unsigned int screen_search_spans(struct tsm_screen *con,
+				 const struct line *line,
+				 const unsigned int **spans);
+
+/* scroll-back line @idx, counted from the oldest one */
+static inline struct line *screen_sb_line(struct tsm_screen *con,
+					  unsigned int idx)
+{
+	uint64_t id = con->sb_first_id + idx;
+	struct sb_chunk *chunk;
+
+	chunk = &con->sb_chunks[(id >> SB_CHUNK_SHIFT) &
+				(con->sb_chunk_num - 1)];
+	if (!chunk->lines)
+		return screen_sb_thaw(con, id);
+
+	chunk->used = con->sb_tick;
+	return chunk->lines[id & SB_CHUNK_MASK];
+}
+
+/* index of the scroll-back line @line, counted from the oldest one */
+static inline unsigned int screen_sb_index(struct tsm_screen *con,
+					   const struct line *line)
+{
+	return line->sb_id - con->sb_first_id;
+}
+
+/* Mark columns [@start, @end) of row @y of the active lines as damaged. While
+ * the view is scrolled into the scroll-back buffer, the row is shifted down
+ * accordingly and dropped if it is not visible. */
+static inline void screen_damage(struct tsm_screen *con, unsigned int y,
+				 unsigned int start, unsigned int end)
+{
+	struct damage *d;
+	uint64_t bit;
+
+	if (con->sb_scrolled) {
+		if (con->sb_count - con->sb_pos_num >= con->size_y - y)
+			return;
+		y += con->sb_count - con->sb_pos_num;
+	}
+	if (y >= con->size_y || start >= end)
+		return;
+
+	d = &con->dmg[y];
+	bit = 1ULL << (y & 63);
+	if (!(con->dmg_rows[y >> 6] & bit)) {
+		con->dmg_rows[y >> 6] |= bit;
+		d->start = start;
+		d->end = end;
+	} else {
+		if (start < d->start)
+			d->start = start;
+		if (end > d->end)
+			d->end = end;
+	}
+}
+
+void screen_damage_all(struct tsm_screen *con);
+
 static inline void screen_inc_age(struct tsm_screen *con)
 {
-	if (!++con->age_cnt) {
+	con->age_cnt = (uint32_t)(con->age_cnt + 1);
+	if (!con->age_cnt) {
 		con->age_reset = 1;
 		++con->age_cnt;
 	}
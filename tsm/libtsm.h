@@ -154,6 +154,7 @@ typedef uint_fast32_t tsm_age_t;
 #define TSM_SCREEN_HIDE_CURSOR	0x10
 #define TSM_SCREEN_FIXED_POS	0x20
 #define TSM_SCREEN_ALTERNATE	0x40
+#define TSM_SCREEN_SYNC_UPDATE	0x80	/* app is drawing a frame (mode 2026) */
 
 struct tsm_screen_attr {
 	int8_t fccode;			/* foreground color code or <0 for rgb */
@@ -183,6 +184,34 @@ typedef int (*tsm_screen_draw_cb) (struct tsm_screen *con,
 				   tsm_age_t age,
 				   void *data);
 
+/* flags of a run passed to tsm_screen_draw_run_cb */
+#define TSM_SCREEN_RUN_COMBINED	0x01	/* one cell of @len code points */
+#define TSM_SCREEN_RUN_SELECTED	0x02	/* selection overlay */
+#define TSM_SCREEN_RUN_CURSOR	0x04	/* cursor overlay */
+#define TSM_SCREEN_RUN_MATCH	0x08	/* search match overlay */
+
+/**
+ * @brief Callback for a run of @cells cells drawn by tsm_screen_draw_runs().
+ *
+ * All cells of a run share @attr, which has the screen-wide inverse mode
+ * applied but neither the cursor nor the selection. @ch holds one code point
+ * per cell, 0 for an empty cell or the cell covered by the wide character
+ * before it. With TSM_SCREEN_RUN_COMBINED it instead holds the @len code points
+ * of a single combined character spanning @cells cells.
+ * Overlay runs repeat cells that were passed before, flagged with
+ * TSM_SCREEN_RUN_MATCH, TSM_SCREEN_RUN_SELECTED or TSM_SCREEN_RUN_CURSOR, in
+ * this order.
+ */
+typedef int (*tsm_screen_draw_run_cb) (struct tsm_screen *con,
+				       const uint32_t *ch,
+				       size_t len,
+				       unsigned int cells,
+				       unsigned int posx,
+				       unsigned int posy,
+				       const struct tsm_screen_attr *attr,
+				       unsigned int flags,
+				       void *data);
+
 int tsm_screen_new(struct tsm_screen **out, tsm_log_t log, void *log_data);
 void tsm_screen_ref(struct tsm_screen *con);
 void tsm_screen_unref(struct tsm_screen *con);
@@ -196,6 +225,22 @@ int tsm_screen_set_margins(struct tsm_screen *con,
 void tsm_screen_set_max_sb(struct tsm_screen *con, unsigned int max);
 void tsm_screen_clear_sb(struct tsm_screen *con);
 
+/**
+ * @brief Limit the memory used by old scroll-back lines.
+ *
+ * Old scroll-back lines are kept compressed. Once they take more than @bytes,
+ * the oldest ones are moved to an unlinked temporary file in $TMPDIR (or
+ * /var/tmp) and read back through mmap() when they are shown again. The file
+ * is gone once the screen is destroyed or the process exits. Combined with a
+ * large tsm_screen_set_max_sb() this keeps memory flat regardless of history
+ * length. 0, the default, keeps everything in memory.
+ *
+ * @retval 0 on success.
+ * @retval -EINVAL if con is NULL.
+ * @retval <0 if the temporary file cannot be created.
+ */
+int tsm_screen_set_sb_budget(struct tsm_screen *con, size_t bytes);
+
 void tsm_screen_sb_up(struct tsm_screen *con, unsigned int num);
 void tsm_screen_sb_down(struct tsm_screen *con, unsigned int num);
 void tsm_screen_sb_page_up(struct tsm_screen *con, unsigned int num);
@@ -204,6 +249,78 @@ void tsm_screen_sb_reset(struct tsm_screen *con);
 unsigned int tsm_screen_sb_get_line_count(struct tsm_screen *con);
 unsigned int tsm_screen_sb_get_line_pos(struct tsm_screen *con);
 
+/**
+ * @brief Scroll the view so the line @id is visible.
+ *
+ * Scroll-back lines are shown in the middle of the view, a line on the screen
+ * resets the view, see tsm_screen_search() for line ids.
+ */
+void tsm_screen_sb_show(struct tsm_screen *con, uint64_t id);
+
+/* flags of tsm_screen_search() */
+#define TSM_SCREEN_SEARCH_REGEX	0x01	/* POSIX extended regular expression */
+#define TSM_SCREEN_SEARCH_ICASE	0x02	/* ignore case; only ASCII for literals */
+
+/* a match of a search on line @id */
+struct tsm_screen_match {
+	uint64_t id;			/* line, see tsm_screen_search() */
+	unsigned int x;			/* first cell */
+	unsigned int cells;		/* number of cells */
+};
+
+/**
+ * @brief Search the scroll-back buffer and screen of @con for @pattern.
+ *
+ * @pattern is UTF-8 and a literal unless TSM_SCREEN_SEARCH_REGEX is given.
+ * Matches never span lines. This replaces any earlier search; a NULL or empty
+ * @pattern just stops it. While a search is active, tsm_screen_draw_runs()
+ * passes the matches in view as TSM_SCREEN_RUN_MATCH overlays.
+ *
+ * Lines are identified by the id of the scroll-back line, counting up from
+ * the oldest line ever pushed; row y of the screen has the id the line will
+ * get once it is pushed, i.e. the id of the newest scroll-back line + 1 + y.
+ *
+ * Returns -EINVAL if @pattern is not a valid regular expression.
+ */
+int tsm_screen_search(struct tsm_screen *con, const char *pattern,
+		      unsigned int flags);
+
+/**
+ * @brief Get the matches of the active search of @con, ordered by position.
+ *
+ * Scroll-back lines are searched once; this only searches the lines pushed
+ * since the last call and the screen, so it is cheap to call for every frame.
+ * @matches stays valid until the next call or until the search is replaced.
+ * Returns -ENOENT if there is no active search.
+ */
+int tsm_screen_search_get_matches(struct tsm_screen *con,
+				  const struct tsm_screen_match **matches,
+				  size_t *num);
+
+/**
+ * @brief Get the line pool counters of @con.
+ *
+ * @hits counts new lines that reused a freed one (e.g. a line evicted from the
+ * scroll-back buffer), @misses counts lines that had to be allocated. Both
+ * include the trimmed copies of lines entering the scroll-back buffer and the
+ * lines of decompressed scroll-back chunks. Either pointer may be NULL.
+ */
+void tsm_screen_get_line_pool_stats(struct tsm_screen *con, uint64_t *hits,
+				    uint64_t *misses);
+
+/**
+ * @brief Get the size of the combined-symbol table of @con.
+ *
+ * @symbols is the number of combined characters (a base character with
+ * combining marks) currently interned and @bytes the memory the table takes.
+ * Symbols no cell refers to anymore are dropped from time to time; @collections
+ * counts how often. A collection renumbers the remaining symbols, so the @id
+ * passed to a tsm_screen_draw_cb for a combined character may stand for a
+ * different one after @collections changed. Any pointer may be NULL.
+ */
+void tsm_screen_get_symbol_stats(struct tsm_screen *con, unsigned int *symbols,
+				 size_t *bytes, uint64_t *collections);
+
 void tsm_screen_set_def_attr(struct tsm_screen *con,
 			     const struct tsm_screen_attr *attr);
 void tsm_screen_reset(struct tsm_screen *con);
@@ -220,6 +337,8 @@ void tsm_screen_reset_all_tabstops(struct tsm_screen *con);
 
 void tsm_screen_write(struct tsm_screen *con, tsm_symbol_t ch,
 		      const struct tsm_screen_attr *attr);
+void tsm_screen_write_run(struct tsm_screen *con, const tsm_symbol_t *syms,
+			  size_t n, const struct tsm_screen_attr *attr);
 void tsm_screen_newline(struct tsm_screen *con);
 void tsm_screen_scroll_up(struct tsm_screen *con, unsigned int num);
 void tsm_screen_scroll_down(struct tsm_screen *con, unsigned int num);
@@ -265,9 +384,109 @@ void tsm_screen_selection_word(struct tsm_screen *con,
 			       unsigned int posy);
 int tsm_screen_selection_copy(struct tsm_screen *con, char **out);
 
+/**
+ * @brief Callback receiving exported text.
+ *
+ * @u8 holds the next @len bytes of UTF-8 text; it is only valid during the
+ * call. Return 0 to continue or a negative error code to abort the export,
+ * which then returns that code. The callback must not modify @con.
+ */
+typedef int (*tsm_screen_export_cb) (struct tsm_screen *con,
+				     const char *u8,
+				     size_t len,
+				     void *data);
+
+/**
+ * @brief Export the selection of @con to @cb.
+ *
+ * This produces the same text as tsm_screen_selection_copy() but hands it to
+ * @cb in chunks as the selected lines are visited, so no buffer for the whole
+ * selection is needed. Returns -ENOENT if nothing is selected.
+ */
+int tsm_screen_selection_export(struct tsm_screen *con,
+				tsm_screen_export_cb cb, void *data);
+
+/**
+ * @brief Export the whole scroll-back buffer and main screen of @con to @cb.
+ *
+ * Lines are separated by line breaks and lose their trailing blanks; empty
+ * lines at the end are dropped. tsm_screen_history_write() writes the same
+ * text to the file descriptor @fd.
+ */
+int tsm_screen_history_export(struct tsm_screen *con,
+			      tsm_screen_export_cb cb, void *data);
+int tsm_screen_history_write(struct tsm_screen *con, int fd);
+
 tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 			  void *data);
 
+/**
+ * @brief Draw the damaged cells of @con as runs of cells.
+ *
+ * Only the damaged columns of damaged rows are visited, see
+ * tsm_screen_next_damage(). Consecutive cells with the same attributes are
+ * passed to @draw_cb as one run; the selection and the cursor follow as
+ * overlay runs of the same row. The damage is left alone, call
+ * tsm_screen_clear_damage() once the frame is done.
+ *
+ * @retval 0 on success.
+ * @retval -EINVAL if con or draw_cb is NULL.
+ */
+int tsm_screen_draw_runs(struct tsm_screen *con,
+			 tsm_screen_draw_run_cb draw_cb, void *data);
+
+struct tsm_screen_scroll {
+	unsigned int top;	/* first row of the scrolled region */
+	unsigned int bottom;	/* last row of the scrolled region */
+	int delta;		/* rows moved up; negative if moved down */
+};
+
+/**
+ * @brief Get scroll @idx since the last tsm_screen_clear_damage().
+ *
+ * Scrolling is not reported as damage of the whole region. Instead, the moves
+ * are recorded in order and a renderer applies them to what it drew last time,
+ * e.g. with memmove() or XCopyArea(); rows moved in from outside the region are
+ * left to the damage. A renderer that cannot move its contents redraws rows
+ * @top to @bottom of each scroll instead.
+ *
+ * @retval 0 on success.
+ * @retval -ENOENT if there are no more than @idx scrolls.
+ * @retval -EINVAL if con or out is NULL.
+ */
+int tsm_screen_get_scroll(struct tsm_screen *con, unsigned int idx,
+			  struct tsm_screen_scroll *out);
+
+/**
+ * @brief Find the next damaged row of @con, starting at row @y.
+ *
+ * The screen records which cells changed since the last
+ * tsm_screen_clear_damage(), as a set of rows with one range of columns each.
+ * Rows are view rows as passed to the draw callback, so scrolling the view into
+ * the scroll-back buffer damages every row. The damage applies to the contents
+ * after the scrolls reported by tsm_screen_get_scroll() were done. A renderer
+ * loops over this until it fails, redraws columns [@start, @end) of each @row,
+ * and then clears the damage. Any of @row, @start and @end may be NULL.
+ *
+ * @retval 0 if a damaged row was found.
+ * @retval -ENOENT if no row at or below @y is damaged.
+ * @retval -EINVAL if con is NULL.
+ */
+int tsm_screen_next_damage(struct tsm_screen *con, unsigned int y,
+			   unsigned int *row, unsigned int *start,
+			   unsigned int *end);
+
+/**
+ * @brief Mark all rows of @con as undamaged and forget its scrolls.
+ */
+void tsm_screen_clear_damage(struct tsm_screen *con);
+
+/**
+ * @brief Mark all rows of @con as damaged, e.g. after the renderer lost what
+ * it drew.
+ */
+void tsm_screen_damage_all(struct tsm_screen *con);
+
 /** @} */
 
 /**
@@ -411,6 +630,16 @@ typedef void (*tsm_vte_osc_cb) (struct tsm_vte *vte,
 				  size_t len,
 				  void *data);
 
+/* flags passed to tsm_vte_osc_chunk_cb */
+#define TSM_VTE_OSC_BEGIN 1	/* first chunk of an OSC payload */
+#define TSM_VTE_OSC_END   2	/* last chunk of an OSC payload */
+
+typedef void (*tsm_vte_osc_chunk_cb) (struct tsm_vte *vte,
+				      const char *u8,
+				      size_t len,
+				      unsigned int flags,
+				      void *data);
+
 typedef void (*tsm_vte_mouse_cb) (struct tsm_vte *vte,
 				  enum tsm_mouse_track_mode track_mode,
 				  bool track_pixels,
@@ -423,6 +652,34 @@ void tsm_vte_ref(struct tsm_vte *vte);
 void tsm_vte_unref(struct tsm_vte *vte);
 
 void tsm_vte_set_osc_cb(struct tsm_vte *vte, tsm_vte_osc_cb osc_cb, void *osc_data);
+
+/**
+ * @brief Stream OSC payloads to a callback in chunks.
+ *
+ * Once set, OSC sequences not handled by the vte itself are passed to @cb
+ * instead of the callback set with tsm_vte_set_osc_cb(). The payload arrives
+ * in NUL-terminated chunks of at most 64KiB, the first one flagged with
+ * TSM_VTE_OSC_BEGIN and the last one with TSM_VTE_OSC_END; short payloads
+ * come in a single call with both flags. Chunks never split a UTF-8
+ * character and there is no limit on the total payload length.
+ *
+ * @param vte The vte object to set on.
+ * @param cb Chunk callback, or NULL to go back to tsm_vte_set_osc_cb().
+ * @param data User data passed to @cb.
+ */
+void tsm_vte_set_osc_chunk_cb(struct tsm_vte *vte, tsm_vte_osc_chunk_cb cb,
+			      void *data);
+
+/**
+ * @brief Set the max length of OSC payloads passed to tsm_vte_osc_cb.
+ *
+ * Longer payloads are cut. The default is 1MiB. Does not apply when a chunk
+ * callback is set.
+ *
+ * @retval 0 on success.
+ * @retval -EINVAL if vte is NULL or @max is 0.
+ */
+int tsm_vte_set_osc_max_len(struct tsm_vte *vte, size_t max);
 void tsm_vte_set_mouse_cb(struct tsm_vte *vte, tsm_vte_mouse_cb mouse_cb, void *mouse_data);
 
 /**
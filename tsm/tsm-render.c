@@ -46,7 +46,7 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 			  void *data)
 {
 	unsigned int cur_x, cur_y;
-	unsigned int i, j, k;
+	unsigned int i, j, k, pos;
 	struct line *iter, *line = NULL;
 	struct cell *cell, empty;
 	struct tsm_screen_attr attr;
@@ -72,7 +72,10 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 
 	/* push each character into rendering pipeline */
 
-	iter = con->sb_pos;
+	pos = con->sb_pos_num;
+	iter = NULL;
+	if (con->sb_scrolled && pos < con->sb_count)
+		iter = screen_sb_line(con, pos);
 	k = 0;
 
 	if (con->sel_active) {
@@ -90,9 +93,8 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 	}
 
 	for (i = 0; i < con->size_y; ++i) {
-		if (iter) {
-			line = iter;
-			iter = iter->next;
+		if (con->sb_scrolled && pos < con->sb_count) {
+			line = screen_sb_line(con, pos++);
 		} else {
 			line = con->lines[k];
 			k++;
@@ -100,14 +102,14 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 
 		if (con->sel_active) {
 			if (con->sel_start.line == line ||
-			    (!con->sel_start.line &&
-			     con->sel_start.y == k - 1))
+			    (!con->sel_start.line && con->sel_start.y >= 0 &&
+			     con->sel_start.y == (int)k - 1))
 				sel_start = true;
 			else
 				sel_start = false;
 			if (con->sel_end.line == line ||
-			    (!con->sel_end.line &&
-			     con->sel_end.y == k - 1))
+			    (!con->sel_end.line && con->sel_end.y >= 0 &&
+			     con->sel_end.y == (int)k - 1))
 				sel_end = true;
 			else
 				sel_end = false;
@@ -115,13 +117,14 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 			was_sel = false;
 		}
 
+		empty.attr = line->fill;
 		for (j = 0; j < con->size_x; ++j) {
 			if (j < line->size)
 				cell = &line->cells[j];
 			else
 				cell = &empty;
 
-			memcpy(&attr, &cell->attr, sizeof(attr));
+			memcpy(&attr, screen_cell_attr(con, cell), sizeof(attr));
 
 			if (con->sel_active) {
 				if (sel_start &&
@@ -198,3 +201,227 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 		return con->age_cnt;
 	}
 }
+
+/* max cells passed in one run; longer runs are split */
+#define RUN_MAX 256
+
+/* line shown in view row @y */
+static struct line *view_line(struct tsm_screen *con, unsigned int y)
+{
+	if (!con->sb_scrolled)
+		return con->lines[y];
+	if (con->sb_pos_num + y < con->sb_count)
+		return screen_sb_line(con, con->sb_pos_num + y);
+	return con->lines[y - (con->sb_count - con->sb_pos_num)];
+}
+
+/* view row of the selection end @sel; negative if it is above the view */
+static int64_t sel_row(struct tsm_screen *con, const struct selection_pos *sel)
+{
+	int64_t top;
+
+	top = con->sb_scrolled ? con->sb_pos_num : con->sb_count;
+	if (sel->line)
+		return (int64_t)screen_sb_index(con, sel->line) - top;
+	if (sel->y == SELECTION_TOP)
+		return -1;
+	return (int64_t)con->sb_count + sel->y - top;
+}
+
+/*
+ * Store the selected columns of view row @y in @spans as pairs of [start, end)
+ * and return the number of pairs. Like tsm_screen_draw(), every selection end
+ * above the row toggles the selection on or off and the cells at the ends
+ * themselves are always selected.
+ */
+static unsigned int sel_spans(struct tsm_screen *con, unsigned int y,
+			      unsigned int *spans)
+{
+	const struct selection_pos *ends[2], *tmp;
+	unsigned int i, x, cur, num;
+	bool in_sel;
+	int64_t row;
+
+	if (!con->sel_active)
+		return 0;
+
+	ends[0] = &con->sel_start;
+	ends[1] = &con->sel_end;
+	if (ends[0]->x > ends[1]->x) {
+		tmp = ends[0];
+		ends[0] = ends[1];
+		ends[1] = tmp;
+	}
+
+	in_sel = false;
+	for (i = 0; i < 2; ++i) {
+		row = sel_row(con, ends[i]);
+		if (row < 0 || (row < y && ends[i]->x < con->size_x))
+			in_sel = !in_sel;
+	}
+
+	num = 0;
+	cur = 0;
+	for (i = 0; i < 2; ++i) {
+		x = ends[i]->x;
+		if (sel_row(con, ends[i]) != y || x >= con->size_x)
+			continue;
+
+		if (x >= cur) {
+			if (num && spans[2 * num - 1] == (in_sel ? cur : x)) {
+				spans[2 * num - 1] = x + 1;
+			} else {
+				spans[2 * num] = in_sel ? cur : x;
+				spans[2 * num + 1] = x + 1;
+				++num;
+			}
+			cur = x + 1;
+		}
+		in_sel = !in_sel;
+	}
+
+	if (in_sel && cur < con->size_x) {
+		if (num && spans[2 * num - 1] == cur) {
+			spans[2 * num - 1] = con->size_x;
+		} else {
+			spans[2 * num] = cur;
+			spans[2 * num + 1] = con->size_x;
+			++num;
+		}
+	}
+
+	return num;
+}
+
+/*
+ * Return the column of the wide character covering column @x of @line or @x
+ * itself if no wide character covers it. Continuation cells left behind when
+ * the first half of a wide character was overwritten belong to no glyph.
+ */
+static unsigned int glyph_start(const struct line *line, unsigned int x)
+{
+	unsigned int i;
+
+	if (x >= line->size)
+		return x;
+
+	for (i = x; i > 0 && !line->cells[i].width; --i)
+		;
+	if (i < x && i + line->cells[i].width > x)
+		return i;
+	return x;
+}
+
+static void draw_span(struct tsm_screen *con, struct line *line,
+		      unsigned int y, unsigned int start, unsigned int end,
+		      unsigned int flags, tsm_screen_draw_run_cb draw_cb,
+		      void *data)
+{
+	uint32_t buf[RUN_MAX];
+	struct tsm_screen_attr attr;
+	struct cell *cell, empty;
+	const uint32_t *ch;
+	unsigned int x, num;
+	uint16_t id;
+	size_t len;
+
+	screen_cell_init(con, &empty);
+	empty.attr = line->fill;
+
+	/* never start or end in the middle of a wide character */
+	start = glyph_start(line, start);
+	x = glyph_start(line, end);
+	if (x < end) {
+		end = x + line->cells[x].width;
+		if (end > con->size_x)
+			end = con->size_x;
+	}
+
+	x = start;
+	while (x < end) {
+		cell = x < line->size ? &line->cells[x] : &empty;
+		id = cell->attr;
+
+		memcpy(&attr, &con->attrs[id], sizeof(attr));
+		if (con->flags & TSM_SCREEN_INVERSE)
+			attr.inverse = !attr.inverse;
+
+		/* combined characters are passed on their own */
+		if (cell->width && cell->ch > TSM_UCS4_MAX) {
+			ch = tsm_symbol_get(con->sym_table, &cell->ch, &len);
+			num = cell->width;
+			if (x + num > end)
+				num = end - x;
+			draw_cb(con, ch, len, num, x, y, &attr,
+				flags | TSM_SCREEN_RUN_COMBINED, data);
+			x += num;
+			continue;
+		}
+
+		num = 0;
+		do {
+			buf[num++] = cell->width ? cell->ch : 0;
+			++x;
+			if (x >= end || num >= RUN_MAX)
+				break;
+			cell = x < line->size ? &line->cells[x] : &empty;
+		} while (cell->attr == id &&
+			 (!cell->width || cell->ch <= TSM_UCS4_MAX));
+
+		draw_cb(con, buf, num, num, x - num, y, &attr, flags, data);
+	}
+}
+
+SHL_EXPORT
+int tsm_screen_draw_runs(struct tsm_screen *con,
+			 tsm_screen_draw_run_cb draw_cb, void *data)
+{
+	unsigned int y, row, start, end, s, e, cur_x, cur_y, i, num;
+	unsigned int spans[4];
+	const unsigned int *match;
+	struct line *line;
+
+	if (!con || !draw_cb)
+		return -EINVAL;
+
+	cur_x = con->cursor_x;
+	if (cur_x >= con->size_x)
+		cur_x = con->size_x - 1;
+	cur_y = con->cursor_y;
+	if (cur_y >= con->size_y)
+		cur_y = con->size_y - 1;
+	if (con->sb_scrolled)
+		cur_y += con->sb_count - con->sb_pos_num;
+
+	for (y = 0; !tsm_screen_next_damage(con, y, &row, &start, &end);
+	     y = row + 1) {
+		line = view_line(con, row);
+		draw_span(con, line, row, start, end, 0, draw_cb, data);
+
+		num = screen_search_spans(con, line, &match);
+		for (i = 0; i < num; ++i) {
+			s = match[2 * i] > start ? match[2 * i] : start;
+			e = match[2 * i + 1] < end ? match[2 * i + 1] : end;
+			if (s < e)
+				draw_span(con, line, row, s, e,
+					  TSM_SCREEN_RUN_MATCH, draw_cb, data);
+		}
+
+		num = sel_spans(con, row, spans);
+		for (i = 0; i < num; ++i) {
+			s = spans[2 * i] > start ? spans[2 * i] : start;
+			e = spans[2 * i + 1] < end ? spans[2 * i + 1] : end;
+			if (s < e)
+				draw_span(con, line, row, s, e,
+					  TSM_SCREEN_RUN_SELECTED, draw_cb,
+					  data);
+		}
+
+		if (row == cur_y && cur_x >= start && cur_x < end &&
+		    !(con->flags & TSM_SCREEN_HIDE_CURSOR))
+			draw_span(con, line, row, cur_x, cur_x + 1,
+				  TSM_SCREEN_RUN_CURSOR, draw_cb, data);
+	}
+
+	return 0;
+}
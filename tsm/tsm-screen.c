@@ -56,11 +56,17 @@
  * information is available.
  */
 
+#define _GNU_SOURCE /* fallocate */
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "libtsm.h"
 #include "libtsm-int.h"
 #include "shl-llog.h"
@@ -110,18 +116,355 @@ static void move_cursor(struct tsm_screen *con, unsigned int x, unsigned int y)
 	c->age = con->age_cnt;
 }
 
-void screen_cell_init_generic(struct tsm_screen *con, struct cell *cell, struct tsm_screen_attr *attr)
+static void screen_cell_init_generic(struct tsm_screen *con, struct cell *cell,
+				     uint16_t attr)
 {
 	cell->ch = 0;
 	cell->width = 1;
 	cell->age = con->age_cnt;
-
-	memcpy(&cell->attr, attr, sizeof(cell->attr));
+	cell->attr = attr;
 }
 
 void screen_cell_init(struct tsm_screen *con, struct cell *cell)
 {
-	screen_cell_init_generic(con, cell, &con->def_attr);
+	screen_cell_init_generic(con, cell, con->def_attr_id);
+}
+
+/*
+ * Attribute table
+ * Every distinct attribute set used by a cell is stored once per screen and
+ * cells refer to it by a 16bit id. Lookups go through a small open-addressing
+ * hash table; ids are never freed individually. If all ids are taken, the
+ * table is garbage-collected: ids still used by any cell are compacted and all
+ * cells are rewritten, which is slow but only happens with more than 64k
+ * distinct attribute sets (mostly true-color images) in the buffer. If even
+ * that is not enough, new attributes fall back to the default ones.
+ */
+
+static void attr_normalize(struct tsm_screen_attr *key,
+			   const struct tsm_screen_attr *attr)
+{
+	/* bitfields leave padding that memcmp() would look at */
+	memset(key, 0, sizeof(*key));
+	key->fccode = attr->fccode;
+	key->bccode = attr->bccode;
+	key->fr = attr->fr;
+	key->fg = attr->fg;
+	key->fb = attr->fb;
+	key->br = attr->br;
+	key->bg = attr->bg;
+	key->bb = attr->bb;
+	key->bold = attr->bold;
+	key->italic = attr->italic;
+	key->underline = attr->underline;
+	key->inverse = attr->inverse;
+	key->protect = attr->protect;
+	key->blink = attr->blink;
+}
+
+static uint32_t attr_hash(const struct tsm_screen_attr *key)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < sizeof(*key); ++i)
+		h = (h ^ p[i]) * 16777619u;
+
+	return h;
+}
+
+static void attr_hash_insert(struct tsm_screen *con, uint16_t id)
+{
+	unsigned int mask = con->attr_hash_size - 1;
+	uint32_t i;
+
+	for (i = attr_hash(&con->attrs[id]) & mask; con->attr_hash[i];
+	     i = (i + 1) & mask)
+		;
+	con->attr_hash[i] = id + 1;
+}
+
+static int attr_hash_resize(struct tsm_screen *con, unsigned int size)
+{
+	uint32_t *tmp;
+	unsigned int i;
+
+	tmp = calloc(size, sizeof(*tmp));
+	if (!tmp)
+		return -ENOMEM;
+
+	free(con->attr_hash);
+	con->attr_hash = tmp;
+	con->attr_hash_size = size;
+	for (i = 0; i < con->attr_num; ++i)
+		attr_hash_insert(con, i);
+
+	return 0;
+}
+
+static void attr_mark_line(struct line *line, uint32_t *map, bool rewrite)
+{
+	unsigned int i;
+
+	for (i = 0; i < line->size; ++i) {
+		if (rewrite)
+			line->cells[i].attr = map[line->cells[i].attr] - 1;
+		else
+			map[line->cells[i].attr] = 1;
+	}
+
+	if (rewrite)
+		line->fill = map[line->fill] - 1;
+	else
+		map[line->fill] = 1;
+}
+
+/* call @mark for every line that holds cells */
+static void screen_mark_lines(struct tsm_screen *con,
+			      void (*mark) (struct line *line, uint32_t *map,
+					    bool rewrite),
+			      uint32_t *map, bool rewrite)
+{
+	struct sb_chunk *chunk;
+	unsigned int i;
+	uint64_t id;
+
+	for (i = 0; i < con->line_num; ++i) {
+		mark(con->main_lines[i], map, rewrite);
+		mark(con->alt_lines[i], map, rewrite);
+	}
+
+	/* compressed chunks store attributes and symbols by value, skip
+	 * them */
+	for (id = con->sb_first_id; con->sb_count && id <= con->sb_last_id;
+	     ++id) {
+		chunk = &con->sb_chunks[(id >> SB_CHUNK_SHIFT) &
+					(con->sb_chunk_num - 1)];
+		if (!chunk->lines)
+			id |= SB_CHUNK_MASK;
+		else
+			mark(chunk->lines[id & SB_CHUNK_MASK], map, rewrite);
+	}
+}
+
+static void screen_attr_gc(struct tsm_screen *con)
+{
+	uint32_t *map;
+	unsigned int i, num;
+
+	map = calloc(TSM_ATTR_MAX, sizeof(*map));
+	if (!map)
+		return;
+
+	map[con->def_attr_id] = 1;
+	screen_mark_lines(con, attr_mark_line, map, false);
+
+	/* new ids are never bigger than old ones so compact in place */
+	for (i = 0, num = 0; i < con->attr_num; ++i) {
+		if (!map[i])
+			continue;
+		con->attrs[num] = con->attrs[i];
+		map[i] = ++num;
+	}
+
+	screen_mark_lines(con, attr_mark_line, map, true);
+	con->def_attr_id = map[con->def_attr_id] - 1;
+	++con->attr_gc_count;
+	con->attr_last = con->def_attr_id;
+
+	llog_debug(con, "attribute table collected, %u of %u ids in use",
+		   num, con->attr_num);
+	con->attr_num = num;
+	memset(con->attr_hash, 0,
+	       con->attr_hash_size * sizeof(*con->attr_hash));
+	for (i = 0; i < num; ++i)
+		attr_hash_insert(con, i);
+
+	free(map);
+}
+
+/* map[0] is the unused dummy index; it holds the size of the map */
+static void sym_mark_line(struct line *line, uint32_t *map, bool rewrite)
+{
+	unsigned int i;
+	uint32_t idx;
+
+	for (i = 0; i < line->size; ++i) {
+		if (line->cells[i].ch <= TSM_UCS4_MAX)
+			continue;
+
+		/* unknown symbols are drawn as the default one anyway */
+		idx = TSM_SYMBOL_INDEX(line->cells[i].ch);
+		if (!idx || idx >= map[0])
+			line->cells[i].ch = tsm_symbol_default;
+		else if (rewrite)
+			line->cells[i].ch = map[idx];
+		else
+			map[idx] = 1;
+	}
+}
+
+/*
+ * Drop the combined symbols no cell refers to anymore. Symbols held by callers
+ * outside of cells are invalid afterwards.
+ */
+static void screen_sym_gc(struct tsm_screen *con)
+{
+	uint32_t *map;
+	unsigned int num, live;
+
+	tsm_symbol_table_get_stats(con->sym_table, &num, NULL);
+	map = calloc(num + 1, sizeof(*map));
+	if (!map)
+		return;
+	map[0] = num + 1;
+
+	screen_mark_lines(con, sym_mark_line, map, false);
+	if (!tsm_symbol_table_collect(con->sym_table, map)) {
+		screen_mark_lines(con, sym_mark_line, map, true);
+		++con->sym_gc_count;
+	}
+
+	/* on failure this backs off like a collection that gained nothing */
+	tsm_symbol_table_get_stats(con->sym_table, &live, NULL);
+	llog_debug(con, "symbol table collected, %u of %u symbols in use",
+		   live, num);
+	con->sym_gc_next = live * 2 > SYM_GC_MIN ? live * 2 : SYM_GC_MIN;
+	free(map);
+}
+
+static void sb_release_lines(struct tsm_screen *con);
+
+/* collect the attribute table so @need more ids fit, after compressing the
+ * scroll-back lines that still hold ids if needed */
+static void screen_attr_make_room(struct tsm_screen *con, unsigned int need)
+{
+	if (con->attr_fallbacks) {
+		llog_warning(con, "attribute table full, %u cells got the default attributes",
+			     con->attr_fallbacks);
+		con->attr_fallbacks = 0;
+	}
+
+	screen_attr_gc(con);
+	if (con->attr_num + need > TSM_ATTR_MAX) {
+		sb_release_lines(con);
+		screen_attr_gc(con);
+	}
+
+	/* collecting walks every cell; if it gained little, fall back to
+	 * the default attributes for a while instead of collecting on every
+	 * new attribute */
+	if (con->attr_num + need > TSM_ATTR_MAX) {
+		con->attr_gc_wait = TSM_ATTR_MAX / 16;
+		llog_warning(con, "attribute table full, %u of %u ids in use after collecting",
+			     con->attr_num, TSM_ATTR_MAX);
+	}
+}
+
+/*
+ * Return the id of @attr in the attribute table, adding it if needed. This can
+ * collect the table and drop the lines of compressed scroll-back chunks, so ids
+ * obtained earlier must not be used afterwards unless they are stored in a
+ * cell.
+ */
+uint16_t screen_attr_intern(struct tsm_screen *con,
+			    const struct tsm_screen_attr *attr)
+{
+	struct tsm_screen_attr key, *tmp;
+	unsigned int mask, size;
+	uint32_t i;
+	uint16_t id;
+
+	attr_normalize(&key, attr);
+	if (con->attr_num &&
+	    !memcmp(&con->attrs[con->attr_last], &key, sizeof(key)))
+		return con->attr_last;
+
+	mask = con->attr_hash_size - 1;
+	for (i = attr_hash(&key) & mask; con->attr_hash[i];
+	     i = (i + 1) & mask) {
+		id = con->attr_hash[i] - 1;
+		if (!memcmp(&con->attrs[id], &key, sizeof(key))) {
+			con->attr_last = id;
+			return id;
+		}
+	}
+
+	if (con->attr_num >= TSM_ATTR_MAX) {
+		if (con->attr_gc_wait)
+			--con->attr_gc_wait;
+		else
+			screen_attr_make_room(con, TSM_ATTR_MAX / 16);
+
+		if (con->attr_num >= TSM_ATTR_MAX) {
+			++con->attr_fallbacks;
+			return con->def_attr_id;
+		}
+	}
+
+	if (con->attr_num >= con->attr_size) {
+		size = con->attr_size * 2;
+		tmp = realloc(con->attrs, size * sizeof(*tmp));
+		if (!tmp)
+			return con->def_attr_id;
+		con->attrs = tmp;
+		con->attr_size = size;
+	}
+	if (con->attr_num * 2 >= con->attr_hash_size &&
+	    attr_hash_resize(con, con->attr_hash_size * 2))
+		return con->def_attr_id;
+
+	id = con->attr_num++;
+	con->attrs[id] = key;
+	attr_hash_insert(con, id);
+	con->attr_last = id;
+	return id;
+}
+
+/*
+ * Lines are allocated together with their cells in a single block. Lines that
+ * are no longer used go to a small per-screen pool and are handed out again by
+ * line_new(), so a scrolling screen with a full scroll-back buffer recycles the
+ * evicted oldest line instead of calling malloc() and free() for every line.
+ * Cells only move into a separate allocation if a line has to grow.
+ * Shorter lines, which only live in the scroll-back buffer, are recycled the
+ * same way through free lists per size class, see line_short_new().
+ */
+
+static bool line_cells_inline(const struct line *line)
+{
+	return line->cells == (struct cell *)(line + 1);
+}
+
+static void line_release(struct line *line)
+{
+	if (!line_cells_inline(line))
+		free(line->cells);
+	free(line);
+}
+
+/* make room for @width cells, keeping the current ones */
+static int line_reserve(struct line *line, unsigned int width)
+{
+	struct cell *tmp;
+
+	if (line->cap >= width)
+		return 0;
+
+	if (line_cells_inline(line)) {
+		tmp = malloc(sizeof(struct cell) * width);
+		if (tmp)
+			memcpy(tmp, line->cells, sizeof(struct cell) * line->size);
+	} else {
+		tmp = realloc(line->cells, sizeof(struct cell) * width);
+	}
+	if (!tmp)
+		return -ENOMEM;
+
+	line->cells = tmp;
+	line->cap = width;
+	return 0;
 }
 
 static int line_new(struct tsm_screen *con, struct line **out,
@@ -133,19 +476,25 @@ static int line_new(struct tsm_screen *con, struct line **out,
 	if (!width)
 		return -EINVAL;
 
-	line = malloc(sizeof(*line));
-	if (!line)
-		return -ENOMEM;
-	line->next = NULL;
-	line->prev = NULL;
+	if (con->line_pool_num) {
+		line = con->line_pool[--con->line_pool_num];
+		if (line_reserve(line, width)) {
+			line_release(line);
+			return -ENOMEM;
+		}
+		++con->line_pool_hits;
+	} else {
+		line = malloc(sizeof(*line) + sizeof(struct cell) * width);
+		if (!line)
+			return -ENOMEM;
+		line->cells = (struct cell *)(line + 1);
+		line->cap = width;
+		++con->line_pool_misses;
+	}
+
 	line->size = width;
 	line->age = con->age_cnt;
-
-	line->cells = malloc(sizeof(struct cell) * width);
-	if (!line->cells) {
-		free(line);
-		return -ENOMEM;
-	}
+	line->fill = con->def_attr_id;
 
 	for (i = 0; i < width; ++i)
 		screen_cell_init(con, &line->cells[i]);
@@ -154,27 +503,158 @@ static int line_new(struct tsm_screen *con, struct line **out,
 	return 0;
 }
 
-static void line_free(struct line *line)
+/*
+ * Allocate a line with room for @size cells, which are left uninitialized. If
+ * its own size class is empty, a line of the next larger class or a pooled
+ * full-width line is taken, so the lines freed when a chunk is compressed or
+ * a line is evicted serve the next ones even if their lengths differ.
+ */
+static struct line *line_short_new(struct tsm_screen *con, unsigned int size)
 {
-	free(line->cells);
-	free(line);
+	unsigned int cls, cap, i;
+	struct line *line;
+
+	cls = (size + LINE_CLASS_CELLS - 1) / LINE_CLASS_CELLS;
+	for (i = cls; i < LINE_CLASS_NUM && !con->line_class[i]; ++i)
+		;
+	if (i < LINE_CLASS_NUM) {
+		line = con->line_class[i];
+		con->line_class[i] = (struct line *)line->cells;
+		--con->line_class_num;
+		++con->line_pool_hits;
+	} else if (con->line_pool_num &&
+		   line_cells_inline(con->line_pool[con->line_pool_num - 1]) &&
+		   con->line_pool[con->line_pool_num - 1]->cap >= size) {
+		line = con->line_pool[--con->line_pool_num];
+		++con->line_pool_hits;
+	} else {
+		cap = cls < LINE_CLASS_NUM ? cls * LINE_CLASS_CELLS : size;
+		line = malloc(sizeof(*line) + sizeof(struct cell) * cap);
+		if (!line)
+			return NULL;
+		line->cap = cap;
+		++con->line_pool_misses;
+	}
+
+	line->cells = (struct cell *)(line + 1);
+	line->size = size;
+	return line;
+}
+
+/* Keep a short line for line_short_new(). Once LINE_CLASS_MAX lines are kept,
+ * a smaller one makes room as larger lines serve more sizes. */
+static bool line_class_put(struct tsm_screen *con, struct line *line)
+{
+	unsigned int cls, i;
+	struct line *victim;
+
+	if (!line_cells_inline(line) || line->cap % LINE_CLASS_CELLS)
+		return false;
+	cls = line->cap / LINE_CLASS_CELLS;
+	if (cls >= LINE_CLASS_NUM)
+		return false;
+
+	if (con->line_class_num >= LINE_CLASS_MAX) {
+		for (i = 0; i < cls && !con->line_class[i]; ++i)
+			;
+		if (i == cls)
+			return false;
+		victim = con->line_class[i];
+		con->line_class[i] = (struct line *)victim->cells;
+		--con->line_class_num;
+		free(victim);
+	}
+
+	line->cells = (struct cell *)con->line_class[cls];
+	con->line_class[cls] = line;
+	++con->line_class_num;
+	return true;
+}
+
+static void line_free(struct tsm_screen *con, struct line *line)
+{
+	if (!line)
+		return;
+
+	if (line->cap >= con->size_x) {
+		if (con->line_pool_num < LINE_POOL_MAX) {
+			con->line_pool[con->line_pool_num++] = line;
+			return;
+		}
+	} else if (line_class_put(con, line)) {
+		return;
+	}
+
+	line_release(line);
+}
+
+/*
+ * Most lines that scroll out of the screen are short, so storing them with the
+ * full screen width wastes a lot of memory on blank cells. Lines are therefore
+ * copied into a block that ends with the last non-blank cell before they are
+ * linked into the scroll-back buffer and the full-width line goes back to the
+ * pool. The attribute of the dropped cells is kept in line->fill and readers
+ * treat the cells past line->size as blank ones with that attribute.
+ */
+static struct line *line_trim(struct tsm_screen *con, struct line *line)
+{
+	struct line *trimmed;
+	const struct cell *cell;
+	unsigned int len;
+	uint16_t fill;
+
+	if (!line->size)
+		return line;
+
+	fill = line->cells[line->size - 1].attr;
+	for (len = line->size; len > 0; --len) {
+		cell = &line->cells[len - 1];
+		if (cell->ch || cell->width != 1 || cell->attr != fill)
+			break;
+	}
+
+	if (len == line->size)
+		return line;
+
+	trimmed = line_short_new(con, len);
+	if (!trimmed)
+		return line;
+
+	trimmed->age = line->age;
+	trimmed->fill = fill;
+	memcpy(trimmed->cells, line->cells, sizeof(struct cell) * len);
+
+	line_free(con, line);
+	return trimmed;
+}
+
+static void line_pool_clear(struct tsm_screen *con)
+{
+	struct line *line;
+	unsigned int i;
+
+	while (con->line_pool_num)
+		line_release(con->line_pool[--con->line_pool_num]);
+
+	for (i = 0; i < LINE_CLASS_NUM; ++i) {
+		while ((line = con->line_class[i])) {
+			con->line_class[i] = (struct line *)line->cells;
+			free(line);
+		}
+	}
+	con->line_class_num = 0;
 }
 
 static int line_resize(struct tsm_screen *con, struct line *line,
 		       unsigned int width)
 {
-	struct cell *tmp;
-
 	if (!line || !width)
 		return -EINVAL;
 
 	if (line->size < width) {
-		tmp = realloc(line->cells, width * sizeof(struct cell));
-		if (!tmp)
+		if (line_reserve(line, width))
 			return -ENOMEM;
 
-		line->cells = tmp;
-
 		while (line->size < width) {
 			screen_cell_init(con, &line->cells[line->size]);
 			++line->size;
@@ -184,14 +664,862 @@ static int line_resize(struct tsm_screen *con, struct line *line,
 	return 0;
 }
 
+static struct sb_chunk *sb_chunk(struct tsm_screen *con, uint64_t id)
+{
+	return &con->sb_chunks[(id >> SB_CHUNK_SHIFT) &
+			       (con->sb_chunk_num - 1)];
+}
+
+/* ids of the lines in the chunk of @id that are still in the buffer */
+static void sb_chunk_range(struct tsm_screen *con, uint64_t id,
+			   uint64_t *first, uint64_t *last)
+{
+	uint64_t base = id & ~(uint64_t)SB_CHUNK_MASK;
+
+	*first = base > con->sb_first_id ? base : con->sb_first_id;
+	*last = base + SB_CHUNK_MASK < con->sb_last_id ?
+		base + SB_CHUNK_MASK : con->sb_last_id;
+}
+
+/* make sure the chunk ring can hold the chunks of all lines up to @id */
+static int sb_reserve(struct tsm_screen *con, uint64_t id)
+{
+	struct sb_chunk *tmp;
+	unsigned int num, i;
+	uint64_t c, first;
+
+	first = con->sb_first_id >> SB_CHUNK_SHIFT;
+	num = (id >> SB_CHUNK_SHIFT) - first + 1;
+	if (num <= con->sb_chunk_num)
+		return 0;
+
+	num = con->sb_chunk_num ? con->sb_chunk_num * 2 : 4;
+	tmp = calloc(num, sizeof(*tmp));
+	if (!tmp)
+		return -ENOMEM;
+
+	/* chunks move to their slot in the bigger ring */
+	if (con->sb_count) {
+		for (c = first;
+		     c <= (con->sb_last_id >> SB_CHUNK_SHIFT); ++c) {
+			i = c & (con->sb_chunk_num - 1);
+			tmp[c & (num - 1)] = con->sb_chunks[i];
+		}
+	}
+
+	free(con->sb_chunks);
+	con->sb_chunks = tmp;
+	con->sb_chunk_num = num;
+	return 0;
+}
+
+static struct line **sb_lines_new(struct tsm_screen *con)
+{
+	struct line **lines = con->sb_chunk_spare;
+
+	con->sb_chunk_spare = NULL;
+	if (!lines)
+		lines = malloc(SB_CHUNK_LEN * sizeof(*lines));
+	return lines;
+}
+
+static void sb_lines_free(struct tsm_screen *con, struct line **lines)
+{
+	if (con->sb_chunk_spare)
+		free(lines);
+	else
+		con->sb_chunk_spare = lines;
+}
+
+/*
+ * Compressed chunks
+ * A compressed chunk starts with the offset of its first line in the chunk,
+ * the number of lines and the attributes used by them, followed by one record
+ * per line: its size, the attribute of the blank cells past it, the runs of
+ * cells with equal attribute and width and finally the characters as UTF-8.
+ * The UTF-8 encoding is extended to the 31bit range of UCS4 symbols like the
+ * original definition; combined symbols are stored as SB_SYM_ESC followed by
+ * their length and their characters. Attributes and symbols are stored by
+ * value so collecting the attribute or symbol table does not need to touch
+ * compressed chunks.
+ */
+
+#define SB_SYM_ESC 0xff
+
+struct sb_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+};
+
+static int sb_buf_reserve(struct sb_buf *buf, size_t n)
+{
+	uint8_t *tmp;
+	size_t size;
+
+	if (buf->len + n <= buf->size)
+		return 0;
+
+	size = buf->size ? buf->size : 1024;
+	while (size < buf->len + n)
+		size *= 2;
+
+	tmp = realloc(buf->data, size);
+	if (!tmp)
+		return -ENOMEM;
+
+	buf->data = tmp;
+	buf->size = size;
+	return 0;
+}
+
+static uint8_t *sb_put_num(uint8_t *p, uint32_t v)
+{
+	while (v >= 0x80) {
+		*p++ = 0x80 | (v & 0x7f);
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static const uint8_t *sb_get_num(const uint8_t *p, uint32_t *out)
+{
+	uint32_t v = 0;
+	unsigned int shift = 0;
+
+	while (*p & 0x80) {
+		v |= (uint32_t)(*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	*out = v | (uint32_t)*p++ << shift;
+	return p;
+}
+
+static uint8_t *sb_put_ucs4(uint8_t *p, uint32_t ch)
+{
+	unsigned int n, i;
+
+	if (ch < 0x80) {
+		*p++ = ch;
+		return p;
+	}
+
+	if (ch < 0x800)
+		n = 2;
+	else if (ch < 0x10000)
+		n = 3;
+	else if (ch < 0x200000)
+		n = 4;
+	else if (ch < 0x4000000)
+		n = 5;
+	else
+		n = 6;
+
+	for (i = n - 1; i > 0; --i) {
+		p[i] = 0x80 | (ch & 0x3f);
+		ch >>= 6;
+	}
+	p[0] = (uint8_t)(0xff00 >> n) | ch;
+	return p + n;
+}
+
+static const uint8_t *sb_get_ucs4(const uint8_t *p, uint32_t *out)
+{
+	uint32_t ch = *p++;
+	unsigned int n;
+
+	if (ch < 0x80) {
+		*out = ch;
+		return p;
+	}
+
+	for (n = 0; ch & (0x40 >> n); ++n)
+		/* empty */ ;
+	ch &= 0x3f >> n;
+	while (n--)
+		ch = ch << 6 | (*p++ & 0x3f);
+
+	*out = ch;
+	return p;
+}
+
+/* a combined symbol takes at most this many bytes */
+#define SB_SYM_MAX (2 + TSM_UCS4_MAXLEN * 6)
+
+static uint8_t *sb_put_sym(struct tsm_screen *con, uint8_t *p,
+			   tsm_symbol_t ch)
+{
+	const uint32_t *ucs4;
+	size_t len, i;
+
+	if (ch <= TSM_UCS4_MAX)
+		return sb_put_ucs4(p, ch);
+
+	ucs4 = tsm_symbol_get(con->sym_table, &ch, &len);
+	*p++ = SB_SYM_ESC;
+	*p++ = len;
+	for (i = 0; i < len; ++i)
+		p = sb_put_ucs4(p, ucs4[i]);
+	return p;
+}
+
+/* combined symbols are interned again; this never collects the table */
+static const uint8_t *sb_get_sym(struct tsm_screen *con, const uint8_t *p,
+				 tsm_symbol_t *out)
+{
+	uint32_t len, ch;
+
+	if (*p != SB_SYM_ESC)
+		return sb_get_ucs4(p, out);
+
+	len = p[1];
+	p = sb_get_ucs4(p + 2, out);
+	while (--len) {
+		p = sb_get_ucs4(p, &ch);
+		*out = tsm_symbol_append(con->sym_table, *out, ch);
+	}
+	return p;
+}
+
+/* index of attribute @id in the chunk that is being compressed */
+static uint32_t sb_attr_index(struct tsm_screen *con, struct sb_buf *attrs,
+			      uint16_t id)
+{
+	uint32_t v = con->sb_attr_map[id];
+	uint32_t idx;
+
+	if (v >> 16 == con->sb_attr_gen)
+		return v & 0xffff;
+
+	idx = attrs->len / sizeof(struct tsm_screen_attr);
+	memcpy(attrs->data + attrs->len, &con->attrs[id],
+	       sizeof(struct tsm_screen_attr));
+	attrs->len += sizeof(struct tsm_screen_attr);
+	con->sb_attr_map[id] = (uint32_t)con->sb_attr_gen << 16 | idx;
+	return idx;
+}
+
+static int sb_encode_line(struct tsm_screen *con, struct sb_buf *buf,
+			  struct sb_buf *attrs, const struct line *line)
+{
+	const struct cell *cells = line->cells;
+	unsigned int i, j;
+	uint8_t *p;
+
+	/* a cell takes at most 15 bytes: a run of its own and a symbol */
+	if (sb_buf_reserve(buf, 10 + line->size * 15) ||
+	    sb_buf_reserve(attrs, (line->size + 1) *
+				  sizeof(struct tsm_screen_attr)))
+		return -ENOMEM;
+
+	p = buf->data + buf->len;
+	p = sb_put_num(p, line->size);
+	p = sb_put_num(p, sb_attr_index(con, attrs, line->fill));
+
+	for (i = 0; i < line->size; i = j) {
+		for (j = i + 1; j < line->size; ++j) {
+			if (cells[j].attr != cells[i].attr ||
+			    cells[j].width != cells[i].width)
+				break;
+		}
+		p = sb_put_num(p, j - i);
+		p = sb_put_num(p, sb_attr_index(con, attrs, cells[i].attr));
+		*p++ = cells[i].width;
+	}
+
+	for (i = 0; i < line->size; ++i) {
+		/* combined symbols do not fit into the reserve above */
+		if (cells[i].ch > TSM_UCS4_MAX) {
+			buf->len = p - buf->data;
+			if (sb_buf_reserve(buf, SB_SYM_MAX + line->size * 6))
+				return -ENOMEM;
+			p = buf->data + buf->len;
+		}
+		p = sb_put_sym(con, p, cells[i].ch);
+	}
+
+	buf->len = p - buf->data;
+	return 0;
+}
+
+/* compress the chunk of @id; its lines stay around until it is shrunk */
+static int sb_chunk_freeze(struct tsm_screen *con, uint64_t id)
+{
+	struct sb_chunk *chunk = sb_chunk(con, id);
+	struct sb_buf buf = { NULL }, attrs = { NULL };
+	uint64_t first, last, i;
+	uint8_t head[16], *p;
+	int ret = -ENOMEM;
+
+	if (!con->sb_attr_map) {
+		con->sb_attr_map = calloc(TSM_ATTR_MAX,
+					  sizeof(*con->sb_attr_map));
+		if (!con->sb_attr_map)
+			return -ENOMEM;
+	}
+
+	if (!++con->sb_attr_gen) {
+		memset(con->sb_attr_map, 0,
+		       TSM_ATTR_MAX * sizeof(*con->sb_attr_map));
+		con->sb_attr_gen = 1;
+	}
+
+	sb_chunk_range(con, id, &first, &last);
+	for (i = first; i <= last; ++i) {
+		if (sb_encode_line(con, &buf, &attrs,
+				   chunk->lines[i & SB_CHUNK_MASK]))
+			goto out;
+	}
+
+	p = sb_put_num(head, first & SB_CHUNK_MASK);
+	p = sb_put_num(p, last - first + 1);
+	p = sb_put_num(p, attrs.len / sizeof(struct tsm_screen_attr));
+
+	chunk->data_len = (p - head) + attrs.len + buf.len;
+	chunk->data = malloc(chunk->data_len);
+	if (!chunk->data)
+		goto out;
+
+	memcpy(chunk->data, head, p - head);
+	memcpy(chunk->data + (p - head), attrs.data, attrs.len);
+	memcpy(chunk->data + (p - head) + attrs.len, buf.data, buf.len);
+	con->sb_mem += chunk->data_len;
+	++con->sb_thawed;
+	ret = 0;
+
+out:
+	free(attrs.data);
+	free(buf.data);
+	return ret;
+}
+
+static int sb_chunk_decode(struct tsm_screen *con, const uint8_t *data,
+			   uint64_t id, struct line **lines)
+{
+	const uint8_t *p = data, *attrs;
+	struct tsm_screen_attr attr;
+	uint64_t base, first, last, lid;
+	uint32_t off, num, nattr, size, fill, n, a, i, j, k, gc;
+	unsigned int wait;
+	struct line *line;
+	uint16_t *ids;
+	tsm_symbol_t ch;
+
+	p = sb_get_num(p, &off);
+	p = sb_get_num(p, &num);
+	p = sb_get_num(p, &nattr);
+	attrs = p;
+	p += nattr * sizeof(struct tsm_screen_attr);
+
+	ids = malloc(nattr * sizeof(*ids));
+	if (!ids)
+		return -ENOMEM;
+
+	/* interning can collect the attribute table and change earlier ids,
+	 * so make room first and, if it collected anyway, intern again without
+	 * collecting; the ids of the first pass are unused then */
+	if (con->attr_num + nattr > TSM_ATTR_MAX)
+		screen_attr_make_room(con, nattr);
+
+	gc = con->attr_gc_count;
+	for (i = 0; i < nattr; ++i) {
+		memcpy(&attr, attrs + i * sizeof(attr), sizeof(attr));
+		ids[i] = screen_attr_intern(con, &attr);
+	}
+
+	if (gc != con->attr_gc_count) {
+		wait = con->attr_gc_wait;
+		con->attr_gc_wait = UINT_MAX;
+		for (i = 0; i < nattr; ++i) {
+			memcpy(&attr, attrs + i * sizeof(attr), sizeof(attr));
+			ids[i] = screen_attr_intern(con, &attr);
+		}
+		con->attr_gc_wait = wait;
+	}
+
+	base = id & ~(uint64_t)SB_CHUNK_MASK;
+	sb_chunk_range(con, id, &first, &last);
+
+	for (i = 0; i < num; ++i) {
+		lid = base + off + i;
+		p = sb_get_num(p, &size);
+		p = sb_get_num(p, &fill);
+
+		/* lines that were dropped meanwhile are skipped */
+		line = NULL;
+		if (lid >= first && lid <= last) {
+			line = line_short_new(con, size);
+			if (!line)
+				goto err_lines;
+
+			line->sb_id = lid;
+			line->age = con->age_cnt;
+			line->fill = ids[fill];
+			lines[lid & SB_CHUNK_MASK] = line;
+		}
+
+		for (j = 0; j < size; j += n) {
+			p = sb_get_num(p, &n);
+			p = sb_get_num(p, &a);
+			for (k = j; line && k < j + n; ++k) {
+				line->cells[k].attr = ids[a];
+				line->cells[k].width = *p;
+				line->cells[k].age = con->age_cnt;
+			}
+			++p;
+		}
+
+		for (j = 0; j < size; ++j) {
+			p = sb_get_sym(con, p, &ch);
+			if (line)
+				line->cells[j].ch = ch;
+		}
+	}
+
+	free(ids);
+	return 0;
+
+err_lines:
+	for (lid = first; lid < base + off + i; ++lid)
+		line_free(con, lines[lid & SB_CHUNK_MASK]);
+	free(ids);
+	return -ENOMEM;
+}
+
+/* A chunk with a selected line keeps its lines as the selection points there.
+ * The selection may still hold pointers to freed lines, so they are only
+ * compared, never followed. */
+static bool sb_chunk_pinned(struct tsm_screen *con, struct sb_chunk *chunk,
+			    uint64_t id)
+{
+	uint64_t first, last;
+	struct line *line;
+
+	if (!con->sel_active)
+		return false;
+
+	sb_chunk_range(con, id, &first, &last);
+	for ( ; first <= last; ++first) {
+		line = chunk->lines[first & SB_CHUNK_MASK];
+		if (line == con->sel_start.line || line == con->sel_end.line)
+			return true;
+	}
+
+	return false;
+}
+
+/* free the lines of a compressed chunk */
+static void sb_chunk_drop(struct tsm_screen *con, struct sb_chunk *chunk,
+			  uint64_t id)
+{
+	uint64_t first, last;
+
+	sb_chunk_range(con, id, &first, &last);
+	for ( ; first <= last; ++first)
+		line_free(con, chunk->lines[first & SB_CHUNK_MASK]);
+
+	sb_lines_free(con, chunk->lines);
+	chunk->lines = NULL;
+	--con->sb_thawed;
+}
+
+/* drop the lines of the least recently used compressed chunks but @keep */
+static void sb_shrink(struct tsm_screen *con, struct sb_chunk *keep)
+{
+	struct sb_chunk *chunk, *victim;
+	uint64_t id, victim_id = 0;
+
+	while (con->sb_thawed > SB_THAWED_MAX) {
+		victim = NULL;
+		for (id = con->sb_first_id & ~(uint64_t)SB_CHUNK_MASK;
+		     id <= con->sb_last_id; id += SB_CHUNK_LEN) {
+			chunk = sb_chunk(con, id);
+			if (chunk == keep || !chunk->lines ||
+			    (!chunk->data && !chunk->spilled) ||
+			    sb_chunk_pinned(con, chunk, id))
+				continue;
+			if (!victim || (int32_t)(chunk->used - victim->used) < 0) {
+				victim = chunk;
+				victim_id = id;
+			}
+		}
+
+		if (!victim)
+			break;
+		sb_chunk_drop(con, victim, victim_id);
+	}
+}
+
+/*
+ * Spill file
+ * With a memory budget set, compressed chunks beyond it are appended to an
+ * unlinked temporary file, oldest first, so it goes away with the screen or
+ * the process. They are mapped again when a line is accessed. Chunks dropped
+ * from the scroll-back buffer are punched out of the file where supported; the
+ * file is truncated once it holds no chunk at all.
+ */
+
+static int sb_file_open(struct tsm_screen *con)
+{
+	const char *dirs[] = { getenv("TMPDIR"), "/var/tmp", "/tmp" };
+	char path[4096];
+	unsigned int i;
+	int fd = -1;
+
+	if (con->sb_fd >= 0)
+		return 0;
+
+	for (i = 0; i < sizeof(dirs) / sizeof(*dirs) && fd < 0; ++i) {
+		if (!dirs[i] || !*dirs[i])
+			continue;
+		if (snprintf(path, sizeof(path), "%s/tsm-sb-XXXXXX",
+			     dirs[i]) >= (int)sizeof(path))
+			continue;
+		fd = mkstemp(path);
+	}
+	if (fd < 0)
+		return -errno;
+
+	unlink(path);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	con->sb_fd = fd;
+	con->sb_file_len = 0;
+	llog_debug(con, "spilling scroll-back to %s", path);
+	return 0;
+}
+
+static int sb_chunk_spill(struct tsm_screen *con, struct sb_chunk *chunk)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < chunk->data_len) {
+		r = pwrite(con->sb_fd, chunk->data + done,
+			   chunk->data_len - done, con->sb_file_len + done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return r ? -errno : -EIO;
+		done += r;
+	}
+
+	chunk->file_off = con->sb_file_len;
+	chunk->spilled = true;
+	con->sb_file_len += chunk->data_len;
+	con->sb_mem -= chunk->data_len;
+	++con->sb_spilled;
+	free(chunk->data);
+	chunk->data = NULL;
+	return 0;
+}
+
+/* move the oldest compressed chunks to the file until sb_mem fits */
+static void sb_spill(struct tsm_screen *con)
+{
+	struct sb_chunk *chunk;
+	uint64_t id;
+	int ret;
+
+	if (!con->sb_mem_max || con->sb_fd < 0 || !con->sb_count)
+		return;
+
+	id = con->sb_first_id & ~(uint64_t)SB_CHUNK_MASK;
+	if (id < con->sb_spill_id)
+		id = con->sb_spill_id;
+
+	for ( ; con->sb_mem > con->sb_mem_max && id <= con->sb_last_id;
+	     id += SB_CHUNK_LEN) {
+		chunk = sb_chunk(con, id);
+		if (chunk->spilled)
+			continue;
+		/* chunks are compressed in order, the rest is still hot */
+		if (!chunk->data)
+			break;
+		ret = sb_chunk_spill(con, chunk);
+		if (ret) {
+			llog_warning(con, "cannot spill scroll-back: %d", ret);
+			break;
+		}
+	}
+
+	con->sb_spill_id = id;
+}
+
+/*
+ * Release the attribute ids held by scroll-back lines: compress the hot chunks
+ * but the newest one and drop the lines of all compressed chunks, which store
+ * attributes by value. The chunk being decompressed has no lines yet and the
+ * selected lines are kept, see sb_chunk_pinned(). Nothing is spilled here as
+ * that frees the compressed data a decompression may be reading; the next
+ * sb_push() does it.
+ */
+static void sb_release_lines(struct tsm_screen *con)
+{
+	struct sb_chunk *chunk;
+	uint64_t id, newest;
+
+	if (!con->sb_count)
+		return;
+
+	newest = con->sb_last_id & ~(uint64_t)SB_CHUNK_MASK;
+	for (id = con->sb_first_id & ~(uint64_t)SB_CHUNK_MASK; id < newest;
+	     id += SB_CHUNK_LEN) {
+		chunk = sb_chunk(con, id);
+		if (!chunk->lines)
+			continue;
+		if (!chunk->data && !chunk->spilled && sb_chunk_freeze(con, id))
+			continue;
+		if (!sb_chunk_pinned(con, chunk, id))
+			sb_chunk_drop(con, chunk, id);
+	}
+}
+
+/* chunks are dropped oldest first, so everything before them is unused */
+static void sb_file_drop(struct tsm_screen *con, struct sb_chunk *chunk)
+{
+	uint64_t end;
+
+	--con->sb_spilled;
+	if (!con->sb_spilled) {
+		if (!ftruncate(con->sb_fd, 0)) {
+			con->sb_file_len = 0;
+			con->sb_file_hole = 0;
+		}
+		return;
+	}
+
+	end = (chunk->file_off + chunk->data_len) &
+	      ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+	if (end <= con->sb_file_hole)
+		return;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (fallocate(con->sb_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      con->sb_file_hole, end - con->sb_file_hole))
+		return;
+#endif
+	con->sb_file_hole = end;
+}
+
+/* map the compressed lines of a spilled chunk; unmap with munmap(*map) */
+static const uint8_t *sb_file_map(struct tsm_screen *con,
+				  const struct sb_chunk *chunk, void **map,
+				  size_t *map_len)
+{
+	uint64_t off;
+
+	off = chunk->file_off & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+	*map_len = chunk->file_off - off + chunk->data_len;
+	*map = mmap(NULL, *map_len, PROT_READ, MAP_SHARED, con->sb_fd, off);
+	if (*map == MAP_FAILED)
+		return NULL;
+
+	return (const uint8_t *)*map + (chunk->file_off - off);
+}
+
+/* slow path of screen_sb_line(): decompress the chunk of line @id */
+struct line *screen_sb_thaw(struct tsm_screen *con, uint64_t id)
+{
+	struct sb_chunk *chunk = sb_chunk(con, id);
+	const uint8_t *data = chunk->data;
+	struct line **lines;
+	void *map = NULL;
+	size_t map_len = 0;
+	int ret;
+
+	if (chunk->spilled)
+		data = sb_file_map(con, chunk, &map, &map_len);
+	if (!data)
+		goto err_blank;
+
+	lines = sb_lines_new(con);
+	ret = lines ? sb_chunk_decode(con, data, id, lines) : -ENOMEM;
+	if (map)
+		munmap(map, map_len);
+	if (ret) {
+		if (lines)
+			sb_lines_free(con, lines);
+		goto err_blank;
+	}
+
+	chunk->lines = lines;
+	chunk->used = ++con->sb_tick;
+	++con->sb_thawed;
+	sb_shrink(con, chunk);
+
+	return lines[id & SB_CHUNK_MASK];
+
+err_blank:
+	llog_warning(con, "cannot decompress scroll-back line %" PRIu64, id);
+	memset(&con->sb_blank, 0, sizeof(con->sb_blank));
+	con->sb_blank.sb_id = id;
+	con->sb_blank.fill = con->def_attr_id;
+	return &con->sb_blank;
+}
+
+/* append @line to the scroll-back buffer */
+static int sb_push(struct tsm_screen *con, struct line *line)
+{
+	uint64_t id = con->sb_last_id + 1;
+	struct sb_chunk *chunk;
+	uint64_t cold;
+	int ret;
+
+	if (!con->sb_count)
+		con->sb_first_id = id;
+
+	ret = sb_reserve(con, id);
+	if (ret)
+		return ret;
+
+	chunk = sb_chunk(con, id);
+	if (!con->sb_count || !(id & SB_CHUNK_MASK)) {
+		chunk->lines = sb_lines_new(con);
+		if (!chunk->lines)
+			return -ENOMEM;
+	}
+
+	line->sb_id = id;
+	chunk->lines[id & SB_CHUNK_MASK] = line;
+	con->sb_last_id = id;
+	++con->sb_count;
+
+	/* starting a new chunk makes the oldest hot one cold */
+	cold = id - SB_HOT_CHUNKS * SB_CHUNK_LEN;
+	if (!(id & SB_CHUNK_MASK) && id >= SB_HOT_CHUNKS * SB_CHUNK_LEN &&
+	    cold >= (con->sb_first_id & ~(uint64_t)SB_CHUNK_MASK) &&
+	    !sb_chunk(con, cold)->data && !sb_chunk(con, cold)->spilled) {
+		if (sb_chunk_freeze(con, cold)) {
+			llog_warning(con, "cannot compress scroll-back lines");
+		} else {
+			sb_shrink(con, NULL);
+			sb_spill(con);
+		}
+	}
+
+	return 0;
+}
+
+static void sb_free_chunk(struct tsm_screen *con, struct sb_chunk *chunk)
+{
+	if (chunk->lines) {
+		sb_lines_free(con, chunk->lines);
+		if (chunk->data || chunk->spilled)
+			--con->sb_thawed;
+	}
+	if (chunk->data)
+		con->sb_mem -= chunk->data_len;
+	if (chunk->spilled)
+		sb_file_drop(con, chunk);
+	free(chunk->data);
+	memset(chunk, 0, sizeof(*chunk));
+}
+
+/* unlink and return the oldest scroll-back line; drops its chunk if it was the
+ * last line in there. Returns NULL if the line is only stored compressed. */
+static struct line *sb_pop(struct tsm_screen *con)
+{
+	uint64_t id = con->sb_first_id;
+	struct sb_chunk *chunk = sb_chunk(con, id);
+	struct line *line = NULL;
+
+	if (chunk->lines)
+		line = chunk->lines[id & SB_CHUNK_MASK];
+
+	++con->sb_first_id;
+	--con->sb_count;
+	if (!(con->sb_first_id & SB_CHUNK_MASK) || !con->sb_count)
+		sb_free_chunk(con, chunk);
+
+	if (line && con->sel_active) {
+		if (con->sel_start.line == line) {
+			con->sel_start.line = NULL;
+			con->sel_start.y = SELECTION_TOP;
+		}
+		if (con->sel_end.line == line) {
+			con->sel_end.line = NULL;
+			con->sel_end.y = SELECTION_TOP;
+		}
+	}
+
+	return line;
+}
+
+/* Lines [@top, @bottom] are moved up by @num rows, or down if @num is
+ * negative. The scroll is recorded so a renderer can move what it has drawn
+ * instead of drawing it again. Damage of the moved rows moves along with them
+ * and only the rows that are scrolled in are damaged. */
+static void screen_damage_scroll(struct tsm_screen *con, unsigned int top,
+				 unsigned int bottom, int num)
+{
+	struct tsm_screen_scroll *last;
+	unsigned int i, y, from, n;
+
+	/* the view shows other rows than the lines that move, or the
+	 * selection moves by whole screen rows */
+	if (con->sb_scrolled || con->sel_active) {
+		screen_damage_all(con);
+		return;
+	}
+
+	last = NULL;
+	if (con->dmg_scroll_num)
+		last = &con->dmg_scrolls[con->dmg_scroll_num - 1];
+	if (last && last->top == top && last->bottom == bottom) {
+		last->delta += num;
+	} else if (con->dmg_scroll_num < DAMAGE_SCROLL_MAX) {
+		last = &con->dmg_scrolls[con->dmg_scroll_num++];
+		last->top = top;
+		last->bottom = bottom;
+		last->delta = num;
+	} else {
+		screen_damage_all(con);
+		return;
+	}
+
+	n = num < 0 ? -num : num;
+	for (i = 0; i <= bottom - top; ++i) {
+		/* walk along the move so each row is read before it is
+		 * overwritten */
+		y = num > 0 ? top + i : bottom - i;
+		con->dmg_rows[y >> 6] &= ~(1ULL << (y & 63));
+
+		if (i + n > bottom - top) {
+			screen_damage(con, y, 0, con->size_x);
+			continue;
+		}
+
+		from = num > 0 ? y + n : y - n;
+		if (con->dmg_rows[from >> 6] & (1ULL << (from & 63))) {
+			con->dmg_rows[y >> 6] |= 1ULL << (y & 63);
+			con->dmg[y] = con->dmg[from];
+		}
+	}
+
+	/* the cursor drawn last time moves, too */
+	if (!con->dmg_cur_hidden && con->dmg_cur_y >= top &&
+	    con->dmg_cur_y <= bottom) {
+		if (num > 0 ? con->dmg_cur_y < top + n :
+			      con->dmg_cur_y + n > bottom)
+			con->dmg_cur_hidden = true;
+		else if (num > 0)
+			con->dmg_cur_y -= n;
+		else
+			con->dmg_cur_y += n;
+	}
+}
+
 /* This links the given line into the scrollback-buffer */
 static void link_to_scrollback(struct tsm_screen *con, struct line *line)
 {
-	struct line *tmp;
-
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
 
+	/* a scrolled view shows the scroll-back buffer, which changes now */
+	if (con->sb_scrolled)
+		screen_damage_all(con);
+
 	if (con->sb_max == 0) {
 		if (con->sel_active) {
 			if (con->sel_start.line == line) {
@@ -203,70 +1531,31 @@ static void link_to_scrollback(struct tsm_screen *con, struct line *line)
 				con->sel_end.y = SELECTION_TOP;
 			}
 		}
-		line_free(line);
+		line_free(con, line);
 		return;
 	}
 
 	/* Remove a line from the scrollback buffer if it reaches its maximum.
-	 * We must take care to correctly keep the current position as the new
-	 * line is linked in after we remove the top-most line here.
-	 * sb_max == 0 is tested earlier so we can assume sb_max > 0 here. In
-	 * other words, buf->sb_first is a valid line if sb_count >= sb_max. */
+	 * With a fixed position the view stays on the same line, which moves
+	 * up by one; if that line is dropped it moves to the next one.
+	 * Otherwise the view moves along with the new line and keeps its
+	 * index. */
 	if (con->sb_count >= con->sb_max) {
-		tmp = con->sb_first;
-		con->sb_first = tmp->next;
-		if (tmp->next)
-			tmp->next->prev = NULL;
-		else
-			con->sb_last = NULL;
-		--con->sb_count;
-
-		/* (position == tmp && !next) means we have sb_max=1 so set
-		 * position to the new line. Otherwise, set to new first line.
-		 * If position!=tmp and we have a fixed-position then nothing
-		 * needs to be done because we can stay at the same line. If we
-		 * have no fixed-position, we need to set the position to the
-		 * next inserted line, which can be "line", too. */
-		if (con->sb_pos) {
-			if (con->sb_pos == tmp ||
-			    !(con->flags & TSM_SCREEN_FIXED_POS)) {
-				if (con->sb_pos->next) {
-					con->sb_pos = con->sb_pos->next;
-					++con->sb_pos_num;
-				} else {
-					con->sb_pos = line;
-					con->sb_pos_num = 0;
-				}
-			}
-		}
+		line_free(con, sb_pop(con));
 
-		if (con->sel_active) {
-			if (con->sel_start.line == tmp) {
-				con->sel_start.line = NULL;
-				con->sel_start.y = SELECTION_TOP;
-			}
-			if (con->sel_end.line == tmp) {
-				con->sel_end.line = NULL;
-				con->sel_end.y = SELECTION_TOP;
-			}
-		}
-		line_free(tmp);
+		if (con->sb_scrolled && (con->flags & TSM_SCREEN_FIXED_POS) &&
+		    con->sb_pos_num)
+			--con->sb_pos_num;
 	}
 
-	line->sb_id = ++con->sb_last_id;
-	line->next = NULL;
-	line->prev = con->sb_last;
-	if (con->sb_last) {
-		con->sb_last->next = line;
-	} else {
-		con->sb_first = line;
+	line = line_trim(con, line);
+	if (sb_push(con, line)) {
+		llog_warning(con, "cannot grow scroll-back buffer");
+		line_free(con, line);
 	}
-	con->sb_last = line;
-	++con->sb_count;
 
-	if (con->sb_pos == NULL) {
+	if (!con->sb_scrolled)
 		con->sb_pos_num = con->sb_count;
-	}
 }
 
 static void screen_scroll_up(struct tsm_screen *con, unsigned int num)
@@ -295,6 +1584,8 @@ static void screen_scroll_up(struct tsm_screen *con, unsigned int num)
 	}
 	struct line *cache[num];
 
+	screen_damage_scroll(con, con->margin_top, con->margin_bottom, num);
+
 	for (i = 0; i < num; ++i) {
 		pos = con->margin_top + i;
 		if (!(con->flags & TSM_SCREEN_ALTERNATE))
@@ -324,18 +1615,18 @@ static void screen_scroll_up(struct tsm_screen *con, unsigned int num)
 		if (!con->sel_start.line && con->sel_start.y >= 0) {
 			con->sel_start.y -= num;
 			if (con->sel_start.y < 0) {
-				con->sel_start.line = con->sb_last;
-				while (con->sel_start.line && ++con->sel_start.y < 0)
-					con->sel_start.line = con->sel_start.line->prev;
+				if ((int)con->sb_count + con->sel_start.y >= 0)
+					con->sel_start.line = screen_sb_line(con,
+						con->sb_count + con->sel_start.y);
 				con->sel_start.y = SELECTION_TOP;
 			}
 		}
 		if (!con->sel_end.line && con->sel_end.y >= 0) {
 			con->sel_end.y -= num;
 			if (con->sel_end.y < 0) {
-				con->sel_end.line = con->sb_last;
-				while (con->sel_end.line && ++con->sel_end.y < 0)
-					con->sel_end.line = con->sel_end.line->prev;
+				if ((int)con->sb_count + con->sel_end.y >= 0)
+					con->sel_end.line = screen_sb_line(con,
+						con->sb_count + con->sel_end.y);
 				con->sel_end.y = SELECTION_TOP;
 			}
 		}
@@ -363,6 +1654,9 @@ static void screen_scroll_down(struct tsm_screen *con, unsigned int num)
 	}
 	struct line *cache[num];
 
+	screen_damage_scroll(con, con->margin_top, con->margin_bottom,
+			     -(int)num);
+
 	for (i = 0; i < num; ++i) {
 		cache[i] = con->lines[con->margin_bottom - i];
 		for (j = 0; j < con->size_x; ++j)
@@ -388,7 +1682,7 @@ static void screen_scroll_down(struct tsm_screen *con, unsigned int num)
 
 static void screen_write(struct tsm_screen *con, unsigned int x,
 			  unsigned int y, tsm_symbol_t ch, unsigned int len,
-			  const struct tsm_screen_attr *attr)
+			  uint16_t attr)
 {
 	struct line *line;
 	unsigned int i;
@@ -408,12 +1702,16 @@ static void screen_write(struct tsm_screen *con, unsigned int x,
 		line->age = con->age_cnt;
 		memmove(&line->cells[x + len], &line->cells[x],
 			sizeof(struct cell) * (con->size_x - len - x));
+		screen_damage(con, y, x, con->size_x);
+	} else {
+		screen_damage(con, y, x, x + len < con->size_x ?
+						x + len : con->size_x);
 	}
 
 	line->cells[x].age = con->age_cnt;
 	line->cells[x].ch = ch;
 	line->cells[x].width = len;
-	memcpy(&line->cells[x].attr, attr, sizeof(*attr));
+	line->cells[x].attr = attr;
 
 	for (i = 1; i < len && i + x < con->size_x; ++i) {
 		line->cells[x + i].age = con->age_cnt;
@@ -431,9 +1729,6 @@ static void screen_erase_region(struct tsm_screen *con,
 	unsigned int to;
 	struct line *line;
 
-	/* TODO: more sophisticated ageing */
-	con->age = con->age_cnt;
-
 	if (y_to >= con->size_y)
 		y_to = con->size_y - 1;
 	if (x_to >= con->size_x)
@@ -450,8 +1745,10 @@ static void screen_erase_region(struct tsm_screen *con,
 			to = x_to;
 		else
 			to = con->size_x - 1;
+		screen_damage(con, y_from, x_from, to + 1);
 		for ( ; x_from <= to; ++x_from) {
-			if (protect && line->cells[x_from].attr.protect)
+			if (protect &&
+			    screen_cell_attr(con, &line->cells[x_from])->protect)
 				continue;
 
 			screen_cell_init(con, &line->cells[x_from]);
@@ -489,6 +1786,7 @@ int tsm_screen_new(struct tsm_screen **out, tsm_log_t log, void *log_data)
 
 	memset(con, 0, sizeof(*con));
 	con->ref = 1;
+	con->sb_fd = -1;
 	con->llog = log;
 	con->llog_data = log_data;
 	con->age_cnt = 1;
@@ -497,9 +1795,20 @@ int tsm_screen_new(struct tsm_screen **out, tsm_log_t log, void *log_data)
 	con->def_attr.fg = 255;
 	con->def_attr.fb = 255;
 
+	con->attr_size = 64;
+	con->attrs = malloc(con->attr_size * sizeof(*con->attrs));
+	con->attr_hash_size = 128;
+	con->attr_hash = calloc(con->attr_hash_size, sizeof(*con->attr_hash));
+	if (!con->attrs || !con->attr_hash) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+	con->def_attr_id = screen_attr_intern(con, &con->def_attr);
+
 	ret = tsm_symbol_table_new(&con->sym_table);
 	if (ret)
 		goto err_free;
+	con->sym_gc_next = SYM_GC_MIN;
 
 	ret = tsm_screen_resize(con, 80, 24);
 	if (ret)
@@ -512,13 +1821,18 @@ int tsm_screen_new(struct tsm_screen **out, tsm_log_t log, void *log_data)
 
 err_free:
 	for (i = 0; i < con->line_num; ++i) {
-		line_free(con->main_lines[i]);
-		line_free(con->alt_lines[i]);
+		line_free(con, con->main_lines[i]);
+		line_free(con, con->alt_lines[i]);
 	}
 	free(con->main_lines);
 	free(con->alt_lines);
+	line_pool_clear(con);
 	free(con->tab_ruler);
+	free(con->dmg_rows);
+	free(con->dmg);
 	tsm_symbol_table_unref(con->sym_table);
+	free(con->attr_hash);
+	free(con->attrs);
 	free(con);
 	return ret;
 }
@@ -543,15 +1857,26 @@ void tsm_screen_unref(struct tsm_screen *con)
 	llog_debug(con, "destroying screen");
 
 	for (i = 0; i < con->line_num; ++i) {
-		line_free(con->main_lines[i]);
-		line_free(con->alt_lines[i]);
+		line_free(con, con->main_lines[i]);
+		line_free(con, con->alt_lines[i]);
 	}
 
 	free(con->main_lines);
 	free(con->alt_lines);
 	free(con->tab_ruler);
+	screen_search_free(con);
 	tsm_symbol_table_unref(con->sym_table);
 	tsm_screen_clear_sb(con);
+	line_pool_clear(con);
+	free(con->dmg_rows);
+	free(con->dmg);
+	free(con->sb_chunk_spare);
+	free(con->sb_chunks);
+	free(con->sb_attr_map);
+	if (con->sb_fd >= 0)
+		close(con->sb_fd);
+	free(con->attr_hash);
+	free(con->attrs);
 	free(con);
 }
 
@@ -603,8 +1928,11 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 {
 	struct line **cache;
 	unsigned int i, j, width, diff, start;
+	uint16_t main_attr;
 	int ret;
 	bool *tab_ruler;
+	struct damage *dmg;
+	uint64_t *dmg_rows;
 
 	if (!con || !x || !y)
 		return -EINVAL;
@@ -620,6 +1948,18 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 	 * lines. Otherwise, if this function fails in later turns, we will have
 	 * invalid lines in the buffer. */
 	if (y > con->line_num) {
+		/* resize damage tracking; it is reset below anyway */
+		dmg = realloc(con->dmg, sizeof(*dmg) * y);
+		if (!dmg)
+			return -ENOMEM;
+		con->dmg = dmg;
+
+		dmg_rows = calloc((y + 63) / 64, sizeof(*dmg_rows));
+		if (!dmg_rows)
+			return -ENOMEM;
+		free(con->dmg_rows);
+		con->dmg_rows = dmg_rows;
+
 		/* resize main buffer */
 		cache = realloc(con->main_lines, sizeof(struct line*) * y);
 		if (!cache)
@@ -653,7 +1993,7 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 			ret = line_new(con, &con->alt_lines[con->line_num],
 				       width);
 			if (ret) {
-				line_free(con->main_lines[con->line_num]);
+				line_free(con, con->main_lines[con->line_num]);
 				return ret;
 			}
 
@@ -683,6 +2023,7 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 	screen_inc_age(con);
 
 	/* clear expansion/padding area */
+	main_attr = screen_attr_intern(con, &con->def_attr_main);
 	start = x;
 	if (x > con->size_x)
 		start = con->size_x;
@@ -694,7 +2035,7 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 
 		for ( ; i < con->main_lines[j]->size; ++i)
 			screen_cell_init_generic(con, &con->main_lines[j]->cells[i],
-				&con->def_attr_main);
+						 main_attr);
 
 		/* alt-lines never go into SB, only clear visible cells */
 		i = 0;
@@ -742,6 +2083,7 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 	if (con->cursor_y >= con->size_y)
 		move_cursor(con, con->cursor_x, con->size_y - 1);
 
+	screen_damage_all(con);
 	return 0;
 }
 
@@ -778,8 +2120,6 @@ SHL_EXPORT
 void tsm_screen_set_max_sb(struct tsm_screen *con,
 			       unsigned int max)
 {
-	struct line *line;
-
 	if (!con)
 		return;
 
@@ -787,42 +2127,26 @@ void tsm_screen_set_max_sb(struct tsm_screen *con,
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
 
+	/* We treat fixed/unfixed position the same here because we remove
+	 * lines from the TOP of the scrollback buffer. */
 	while (con->sb_count > max) {
-		line = con->sb_first;
-		con->sb_first = line->next;
-		if (line->next)
-			line->next->prev = NULL;
-		else
-			con->sb_last = NULL;
-		con->sb_count--;
-
-		/* We treat fixed/unfixed position the same here because we
-		 * remove lines from the TOP of the scrollback buffer. */
-		if (con->sb_pos == line)
-			con->sb_pos = con->sb_first;
-
-		if (con->sel_active) {
-			if (con->sel_start.line == line) {
-				con->sel_start.line = NULL;
-				con->sel_start.y = SELECTION_TOP;
-			}
-			if (con->sel_end.line == line) {
-				con->sel_end.line = NULL;
-				con->sel_end.y = SELECTION_TOP;
-			}
-		}
-		line_free(line);
+		line_free(con, sb_pop(con));
+		if (con->sb_pos_num)
+			--con->sb_pos_num;
 	}
+	if (!con->sb_count)
+		con->sb_scrolled = false;
+	if (!con->sb_scrolled)
+		con->sb_pos_num = con->sb_count;
 
 	con->sb_max = max;
+	screen_damage_all(con);
 }
 
 /* clear scrollback buffer */
 SHL_EXPORT
 void tsm_screen_clear_sb(struct tsm_screen *con)
 {
-	struct line *iter, *tmp;
-
 	if (!con)
 		return;
 
@@ -830,16 +2154,12 @@ void tsm_screen_clear_sb(struct tsm_screen *con)
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
 
-	for (iter = con->sb_first; iter; ) {
-		tmp = iter;
-		iter = iter->next;
-		line_free(tmp);
-	}
+	while (con->sb_count)
+		line_free(con, sb_pop(con));
 
-	con->sb_first = NULL;
-	con->sb_last = NULL;
-	con->sb_count = 0;
-	con->sb_pos = NULL;
+	if (con->sb_scrolled)
+		screen_damage_all(con);
+	con->sb_scrolled = false;
 	con->sb_pos_num = 0;
 
 	if (con->sel_active) {
@@ -854,6 +2174,25 @@ void tsm_screen_clear_sb(struct tsm_screen *con)
 	}
 }
 
+SHL_EXPORT
+int tsm_screen_set_sb_budget(struct tsm_screen *con, size_t bytes)
+{
+	int ret;
+
+	if (!con)
+		return -EINVAL;
+
+	if (bytes) {
+		ret = sb_file_open(con);
+		if (ret)
+			return ret;
+	}
+
+	con->sb_mem_max = bytes;
+	sb_spill(con);
+	return 0;
+}
+
 SHL_EXPORT
 void tsm_screen_sb_up(struct tsm_screen *con, unsigned int num)
 {
@@ -864,20 +2203,18 @@ void tsm_screen_sb_up(struct tsm_screen *con, unsigned int num)
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
 
-	while (num--) {
-		if (con->sb_pos) {
-			if (!con->sb_pos->prev)
-				return;
+	if (!con->sb_count)
+		return;
 
-			con->sb_pos = con->sb_pos->prev;
-			--con->sb_pos_num;
-		} else if (!con->sb_last) {
-			return;
-		} else {
-			con->sb_pos = con->sb_last;
-			con->sb_pos_num = con->sb_count - 1;
-		}
+	if (!con->sb_scrolled) {
+		con->sb_scrolled = true;
+		con->sb_pos_num = con->sb_count;
 	}
+
+	if (num > con->sb_pos_num)
+		num = con->sb_pos_num;
+	con->sb_pos_num -= num;
+	screen_damage_all(con);
 }
 
 SHL_EXPORT
@@ -890,14 +2227,16 @@ void tsm_screen_sb_down(struct tsm_screen *con, unsigned int num)
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
 
-	while (num--) {
-		if (con->sb_pos) {
-			con->sb_pos = con->sb_pos->next;
-			++con->sb_pos_num;
-		}
-		else
-			return;
+	if (!con->sb_scrolled)
+		return;
+
+	if (num >= con->sb_count - con->sb_pos_num) {
+		con->sb_scrolled = false;
+		con->sb_pos_num = con->sb_count;
+	} else {
+		con->sb_pos_num += num;
 	}
+	screen_damage_all(con);
 }
 
 SHL_EXPORT
@@ -923,15 +2262,47 @@ void tsm_screen_sb_page_down(struct tsm_screen *con, unsigned int num)
 SHL_EXPORT
 void tsm_screen_sb_reset(struct tsm_screen *con)
 {
-	if (!con || !con->sb_pos)
+	if (!con || !con->sb_scrolled)
 		return;
 
 	screen_inc_age(con);
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
 
-	con->sb_pos = NULL;
-	con->sb_pos_num = 0;
+	con->sb_scrolled = false;
+	con->sb_pos_num = con->sb_count;
+	screen_damage_all(con);
+}
+
+SHL_EXPORT
+void tsm_screen_sb_show(struct tsm_screen *con, uint64_t id)
+{
+	unsigned int idx, top;
+
+	if (!con)
+		return;
+
+	if (!con->sb_count || id > con->sb_last_id) {
+		tsm_screen_sb_reset(con);
+		return;
+	}
+
+	if (id < con->sb_first_id)
+		id = con->sb_first_id;
+	idx = id - con->sb_first_id;
+	if (con->sb_scrolled && idx >= con->sb_pos_num &&
+	    idx - con->sb_pos_num < con->size_y)
+		return;
+
+	/* the view moves; tsm_screen_draw() users only see that through the
+	 * screen age, tsm_screen_draw_runs() through the damage */
+	screen_inc_age(con);
+	con->age = con->age_cnt;
+
+	top = idx > con->size_y / 2 ? idx - con->size_y / 2 : 0;
+	con->sb_scrolled = true;
+	con->sb_pos_num = top;
+	screen_damage_all(con);
 }
 
 unsigned int tsm_screen_sb_get_line_count(struct tsm_screen *con)
@@ -952,6 +2323,143 @@ unsigned int tsm_screen_sb_get_line_pos(struct tsm_screen *con)
 	return con->sb_pos_num;
 }
 
+SHL_EXPORT
+void tsm_screen_get_line_pool_stats(struct tsm_screen *con, uint64_t *hits,
+				    uint64_t *misses)
+{
+	if (hits)
+		*hits = con ? con->line_pool_hits : 0;
+	if (misses)
+		*misses = con ? con->line_pool_misses : 0;
+}
+
+SHL_EXPORT
+void tsm_screen_get_symbol_stats(struct tsm_screen *con, unsigned int *symbols,
+				 size_t *bytes, uint64_t *collections)
+{
+	tsm_symbol_table_get_stats(con ? con->sym_table : NULL, symbols,
+				   bytes);
+	if (collections)
+		*collections = con ? con->sym_gc_count : 0;
+}
+
+void screen_damage_all(struct tsm_screen *con)
+{
+	unsigned int i;
+
+	for (i = 0; i < con->size_y; ++i) {
+		con->dmg_rows[i >> 6] |= 1ULL << (i & 63);
+		con->dmg[i].start = 0;
+		con->dmg[i].end = con->size_x;
+	}
+
+	/* everything is redrawn, moving the old contents is pointless */
+	con->dmg_scroll_num = 0;
+}
+
+/* The cursor is moved in a lot of places, so instead of tracking each move
+ * the cells it left and entered are damaged when the damage is queried. */
+static void screen_damage_cursor(struct tsm_screen *con)
+{
+	unsigned int x, y;
+	bool hidden;
+
+	hidden = con->flags & TSM_SCREEN_HIDE_CURSOR;
+	x = con->cursor_x;
+	if (x >= con->size_x)
+		x = con->size_x - 1;
+	y = con->cursor_y;
+	if (y >= con->size_y)
+		y = con->size_y - 1;
+
+	if (hidden == con->dmg_cur_hidden && x == con->dmg_cur_x &&
+	    y == con->dmg_cur_y)
+		return;
+
+	if (!con->dmg_cur_hidden && con->dmg_cur_x < con->size_x &&
+	    con->dmg_cur_y < con->size_y)
+		screen_damage(con, con->dmg_cur_y, con->dmg_cur_x,
+			      con->dmg_cur_x + 1);
+	if (!hidden)
+		screen_damage(con, y, x, x + 1);
+}
+
+SHL_EXPORT
+int tsm_screen_next_damage(struct tsm_screen *con, unsigned int y,
+			   unsigned int *row, unsigned int *start,
+			   unsigned int *end)
+{
+	uint64_t word;
+
+	if (!con)
+		return -EINVAL;
+
+	screen_damage_cursor(con);
+
+	while (y < con->size_y) {
+		word = con->dmg_rows[y >> 6] >> (y & 63);
+		if (!word) {
+			y = (y | 63) + 1;
+			continue;
+		}
+
+		y += __builtin_ctzll(word);
+		if (y >= con->size_y)
+			break;
+
+		if (row)
+			*row = y;
+		if (start)
+			*start = con->dmg[y].start;
+		if (end)
+			*end = con->dmg[y].end;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+SHL_EXPORT
+void tsm_screen_damage_all(struct tsm_screen *con)
+{
+	if (!con)
+		return;
+
+	screen_damage_all(con);
+}
+
+SHL_EXPORT
+int tsm_screen_get_scroll(struct tsm_screen *con, unsigned int idx,
+			  struct tsm_screen_scroll *out)
+{
+	if (!con || !out)
+		return -EINVAL;
+	if (idx >= con->dmg_scroll_num)
+		return -ENOENT;
+
+	*out = con->dmg_scrolls[idx];
+	return 0;
+}
+
+SHL_EXPORT
+void tsm_screen_clear_damage(struct tsm_screen *con)
+{
+	if (!con)
+		return;
+
+	con->dmg_scroll_num = 0;
+	memset(con->dmg_rows, 0,
+	       sizeof(*con->dmg_rows) * ((con->line_num + 63) / 64));
+
+	con->dmg_cur_hidden = con->flags & TSM_SCREEN_HIDE_CURSOR;
+	con->dmg_cur_x = con->cursor_x;
+	if (con->dmg_cur_x >= con->size_x)
+		con->dmg_cur_x = con->size_x - 1;
+	con->dmg_cur_y = con->cursor_y;
+	if (con->dmg_cur_y >= con->size_y)
+		con->dmg_cur_y = con->size_y - 1;
+}
+
 SHL_EXPORT
 void tsm_screen_set_def_attr(struct tsm_screen *con,
 				 const struct tsm_screen_attr *attr)
@@ -960,6 +2468,7 @@ void tsm_screen_set_def_attr(struct tsm_screen *con,
 		return;
 	memcpy(&con->def_attr, attr, sizeof(*attr));
 	memcpy(&con->def_attr_main, attr, sizeof(*attr));
+	con->def_attr_id = screen_attr_intern(con, &con->def_attr);
 }
 
 SHL_EXPORT
@@ -977,6 +2486,7 @@ void tsm_screen_reset(struct tsm_screen *con)
 	con->margin_top = 0;
 	con->margin_bottom = con->size_y - 1;
 	con->lines = con->main_lines;
+	screen_damage_all(con);
 
 	for (i = 0; i < con->size_x; ++i) {
 		if (i % 8 == 0)
@@ -1003,6 +2513,7 @@ void tsm_screen_set_flags(struct tsm_screen *con, unsigned int flags)
 	if (!(old & TSM_SCREEN_ALTERNATE) && (flags & TSM_SCREEN_ALTERNATE)) {
 		con->age = con->age_cnt;
 		con->lines = con->alt_lines;
+		screen_damage_all(con);
 
 		/* save attributes of main screen when we switch to alt screen */
 		memcpy(&con->def_attr_main, &con->def_attr, sizeof(con->def_attr));
@@ -1014,8 +2525,10 @@ void tsm_screen_set_flags(struct tsm_screen *con, unsigned int flags)
 		c->age = con->age_cnt;
 	}
 
-	if (!(old & TSM_SCREEN_INVERSE) && (flags & TSM_SCREEN_INVERSE))
+	if (!(old & TSM_SCREEN_INVERSE) && (flags & TSM_SCREEN_INVERSE)) {
 		con->age = con->age_cnt;
+		screen_damage_all(con);
+	}
 }
 
 SHL_EXPORT
@@ -1035,6 +2548,7 @@ void tsm_screen_reset_flags(struct tsm_screen *con, unsigned int flags)
 	if ((old & TSM_SCREEN_ALTERNATE) && (flags & TSM_SCREEN_ALTERNATE)) {
 		con->age = con->age_cnt;
 		con->lines = con->main_lines;
+		screen_damage_all(con);
 	}
 
 	if ((old & TSM_SCREEN_HIDE_CURSOR) &&
@@ -1043,8 +2557,10 @@ void tsm_screen_reset_flags(struct tsm_screen *con, unsigned int flags)
 		c->age = con->age_cnt;
 	}
 
-	if ((old & TSM_SCREEN_INVERSE) && (flags & TSM_SCREEN_INVERSE))
+	if ((old & TSM_SCREEN_INVERSE) && (flags & TSM_SCREEN_INVERSE)) {
 		con->age = con->age_cnt;
+		screen_damage_all(con);
+	}
 }
 
 SHL_EXPORT
@@ -1104,18 +2620,14 @@ void tsm_screen_reset_all_tabstops(struct tsm_screen *con)
 		con->tab_ruler[i] = false;
 }
 
-SHL_EXPORT
-void tsm_screen_write(struct tsm_screen *con, tsm_symbol_t ch,
-			  const struct tsm_screen_attr *attr)
+/*
+ * Prepare writing at the cursor position: perform a pending line-wrap and
+ * scroll if the cursor moved below the scroll region. Afterwards the cursor is
+ * always inside the buffer.
+ */
+static void screen_prepare_write(struct tsm_screen *con)
 {
-	unsigned int last, len;
-
-	if (!con)
-		return;
-
-	len = tsm_symbol_get_width(con->sym_table, ch);
-	if (!len)
-		return;
+	unsigned int last;
 
 	screen_inc_age(con);
 
@@ -1136,11 +2648,244 @@ void tsm_screen_write(struct tsm_screen *con, tsm_symbol_t ch,
 		move_cursor(con, con->cursor_x, last);
 		screen_scroll_up(con, 1);
 	}
+}
+
+SHL_EXPORT
+void tsm_screen_write(struct tsm_screen *con, tsm_symbol_t ch,
+			  const struct tsm_screen_attr *attr)
+{
+	unsigned int len;
+	uint16_t id;
+
+	if (!con)
+		return;
+
+	len = tsm_symbol_get_width(con->sym_table, ch);
+	if (!len)
+		return;
 
-	screen_write(con, con->cursor_x, con->cursor_y, ch, len, attr);
+	id = screen_attr_intern(con, attr);
+	screen_prepare_write(con);
+
+	screen_write(con, con->cursor_x, con->cursor_y, ch, len, id);
 	move_cursor(con, con->cursor_x + len, con->cursor_y);
 }
 
+/*
+ * Write a run of symbols. This has the same effect as calling
+ * tsm_screen_write() for each symbol, but the wrap and scroll handling is only
+ * done once per line segment and all cells of a segment share one age.
+ */
+SHL_EXPORT
+void tsm_screen_write_run(struct tsm_screen *con, const tsm_symbol_t *syms,
+			  size_t n, const struct tsm_screen_attr *attr)
+{
+	unsigned int x, len;
+	uint16_t id;
+
+	if (!con || !syms)
+		return;
+
+	id = screen_attr_intern(con, attr);
+	while (n) {
+		len = tsm_symbol_get_width(con->sym_table, *syms);
+		if (!len) {
+			++syms;
+			--n;
+			continue;
+		}
+
+		screen_prepare_write(con);
+
+		x = con->cursor_x;
+		while (1) {
+			screen_write(con, x, con->cursor_y, *syms, len, id);
+			x += len;
+			++syms;
+			--n;
+			if (!n || x >= con->size_x)
+				break;
+			len = tsm_symbol_get_width(con->sym_table, *syms);
+		}
+
+		move_cursor(con, x, con->cursor_y);
+	}
+}
+
+/*
+ * Write @num copies of @ch. This has the same effect as calling
+ * tsm_screen_write() @num times, but each line segment is filled in one pass.
+ */
+void tsm_screen_write_repeat(struct tsm_screen *con, tsm_symbol_t ch,
+			     size_t num, const struct tsm_screen_attr *attr)
+{
+	unsigned int x, len, i, j, cnt;
+	struct line *line;
+	struct cell *cell;
+	uint16_t id;
+
+	if (!con || !num)
+		return;
+
+	len = tsm_symbol_get_width(con->sym_table, ch);
+	if (!len)
+		return;
+
+	id = screen_attr_intern(con, attr);
+	while (num) {
+		/* without auto-wrap all copies past the line end end up in
+		 * the last cell */
+		if (con->cursor_x >= con->size_x &&
+		    !(con->flags & TSM_SCREEN_AUTO_WRAP))
+			num = 1;
+
+		screen_prepare_write(con);
+
+		x = con->cursor_x;
+		cnt = (con->size_x - x + len - 1) / len;
+		if (cnt > num)
+			cnt = num;
+
+		if (con->flags & TSM_SCREEN_INSERT_MODE) {
+			for (i = 0; i < cnt; ++i)
+				screen_write(con, x + i * len, con->cursor_y,
+					     ch, len, id);
+		} else {
+			line = con->lines[con->cursor_y];
+			screen_damage(con, con->cursor_y, x,
+				      x + cnt * len < con->size_x ?
+						x + cnt * len : con->size_x);
+			for (i = 0; i < cnt; ++i) {
+				cell = &line->cells[x + i * len];
+				cell->age = con->age_cnt;
+				cell->ch = ch;
+				cell->width = len;
+				cell->attr = id;
+
+				for (j = 1; j < len &&
+					    x + i * len + j < con->size_x; ++j) {
+					cell[j].age = con->age_cnt;
+					cell[j].width = 0;
+				}
+			}
+		}
+
+		move_cursor(con, x + cnt * len, con->cursor_y);
+		num -= cnt;
+	}
+}
+
+/*
+ * Append the zero-width code point @ucs4 to the symbol of the cell written
+ * last. That is the cell left of the cursor, so the caller must make sure
+ * nothing but writes happened since. The width of the cell does not change.
+ * Returns the new symbol or 0 if there is no cell to append to.
+ */
+tsm_symbol_t tsm_screen_compose(struct tsm_screen *con, uint32_t ucs4)
+{
+	unsigned int x;
+	struct line *line;
+	struct cell *cell;
+	tsm_symbol_t sym;
+
+	unsigned int num;
+
+	if (!con || con->cursor_y >= con->size_y)
+		return 0;
+
+	x = con->cursor_x;
+	if (x > con->size_x)
+		x = con->size_x;
+	if (!x)
+		return 0;
+
+	/* this is the only place new symbols come from, collect here so
+	 * the cell found below stays valid */
+	tsm_symbol_table_get_stats(con->sym_table, &num, NULL);
+	if (num >= con->sym_gc_next)
+		screen_sym_gc(con);
+
+	/* step back over the continuation cells of a wide character */
+	line = con->lines[con->cursor_y];
+	do {
+		cell = &line->cells[--x];
+	} while (x > 0 && !cell->width);
+	if (!cell->width)
+		return 0;
+
+	sym = tsm_symbol_append(con->sym_table, cell->ch, ucs4);
+	if (sym == cell->ch)
+		return 0;
+
+	screen_inc_age(con);
+	cell->ch = sym;
+	cell->age = con->age_cnt;
+	screen_damage(con, con->cursor_y, x, x + cell->width < con->size_x ?
+					      x + cell->width : con->size_x);
+	return sym;
+}
+
+/*
+ * Write a run of printable ASCII characters. This has the same effect as calling
+ * tsm_screen_write() for each byte, but fills whole line segments at once and
+ * only performs the wrap/scroll checks at segment boundaries. The caller must
+ * guarantee that every byte is in the range 0x20-0x7e so all characters are
+ * single-width symbols that map to themselves.
+ */
+void tsm_screen_write_ascii(struct tsm_screen *con, const char *u8, size_t len,
+			    const struct tsm_screen_attr *attr)
+{
+	unsigned int x, num, i;
+	struct line *line;
+	struct cell *cell;
+	uint16_t id;
+
+	if (!con || !len)
+		return;
+
+	id = screen_attr_intern(con, attr);
+	while (len) {
+		/* without auto-wrap every character past the line end
+		 * overwrites the last cell, so only the final one is visible */
+		if (con->cursor_x >= con->size_x &&
+		    !(con->flags & TSM_SCREEN_AUTO_WRAP)) {
+			u8 += len - 1;
+			len = 1;
+		}
+
+		screen_prepare_write(con);
+
+		x = con->cursor_x;
+		num = con->size_x - x;
+		if (num > len)
+			num = len;
+
+		line = con->lines[con->cursor_y];
+
+		if ((con->flags & TSM_SCREEN_INSERT_MODE) &&
+		    x + num < con->size_x) {
+			line->age = con->age_cnt;
+			memmove(&line->cells[x + num], &line->cells[x],
+				sizeof(struct cell) * (con->size_x - num - x));
+			screen_damage(con, con->cursor_y, x, con->size_x);
+		} else {
+			screen_damage(con, con->cursor_y, x, x + num);
+		}
+
+		for (i = 0; i < num; ++i) {
+			cell = &line->cells[x + i];
+			cell->age = con->age_cnt;
+			cell->ch = (unsigned char)u8[i];
+			cell->width = 1;
+			cell->attr = id;
+		}
+
+		move_cursor(con, x + num, con->cursor_y);
+		u8 += num;
+		len -= num;
+	}
+}
+
 SHL_EXPORT
 void tsm_screen_newline(struct tsm_screen *con)
 {
@@ -1395,6 +3140,9 @@ void tsm_screen_insert_lines(struct tsm_screen *con, unsigned int num)
 	if (num > max)
 		num = max;
 
+	screen_damage_scroll(con, con->cursor_y, con->margin_bottom,
+			     -(int)num);
+
 	struct line *cache[num];
 
 	for (i = 0; i < num; ++i) {
@@ -1435,6 +3183,8 @@ void tsm_screen_delete_lines(struct tsm_screen *con, unsigned int num)
 	if (num > max)
 		num = max;
 
+	screen_damage_scroll(con, con->cursor_y, con->margin_bottom, num);
+
 	struct line *cache[num];
 
 	for (i = 0; i < num; ++i) {
@@ -1465,8 +3215,6 @@ void tsm_screen_insert_chars(struct tsm_screen *con, unsigned int num)
 		return;
 
 	screen_inc_age(con);
-	/* TODO: more sophisticated ageing */
-	con->age = con->age_cnt;
 
 	if (con->cursor_x >= con->size_x)
 		con->cursor_x = con->size_x - 1;
@@ -1478,6 +3226,10 @@ void tsm_screen_insert_chars(struct tsm_screen *con, unsigned int num)
 		num = max;
 	mv = max - num;
 
+	/* shifted cells keep their age, so age the whole line */
+	con->lines[con->cursor_y]->age = con->age_cnt;
+	screen_damage(con, con->cursor_y, con->cursor_x, con->size_x);
+
 	cells = con->lines[con->cursor_y]->cells;
 	if (mv)
 		memmove(&cells[con->cursor_x + num],
@@ -1498,8 +3250,6 @@ void tsm_screen_delete_chars(struct tsm_screen *con, unsigned int num)
 		return;
 
 	screen_inc_age(con);
-	/* TODO: more sophisticated ageing */
-	con->age = con->age_cnt;
 
 	if (con->cursor_x >= con->size_x)
 		con->cursor_x = con->size_x - 1;
@@ -1511,6 +3261,10 @@ void tsm_screen_delete_chars(struct tsm_screen *con, unsigned int num)
 		num = max;
 	mv = max - num;
 
+	/* shifted cells keep their age, so age the whole line */
+	con->lines[con->cursor_y]->age = con->age_cnt;
+	screen_damage(con, con->cursor_y, con->cursor_x, con->size_x);
+
 	cells = con->lines[con->cursor_y]->cells;
 	if (mv)
 		memmove(&cells[con->cursor_x],
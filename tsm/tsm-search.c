@@ -0,0 +1,493 @@
+/*
+ * libtsm - Scroll-back Search
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Scroll-back Search
+ * A search looks for a literal string or a POSIX extended regular expression
+ * in the scroll-back buffer and the screen. Every line is searched on its own,
+ * matches never span lines.
+ *
+ * To search a line, its cells are converted into a UTF-8 shadow string that
+ * remembers the cell of every byte. Literals are found with a vectorised
+ * memmem(), regular expressions with regexec(). The shadow only lives while
+ * its line is searched.
+ *
+ * Scroll-back lines never change once they are pushed, so each of them is
+ * searched only once: the matches are kept and only lines pushed since the
+ * last update are searched again, while matches on dropped lines are
+ * forgotten. The screen is searched again on every update.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libtsm.h"
+#include "libtsm-int.h"
+#include "shl-llog.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define LLOG_SUBSYSTEM "tsm-search"
+
+struct screen_search {
+	unsigned int flags;
+	char *pattern;
+	size_t pattern_len;
+	regex_t re;
+
+	/* matches[first, sb_num) are on scroll-back lines, the ones after
+	 * that on the screen */
+	struct tsm_screen_match *matches;
+	size_t first;
+	size_t sb_num;
+	size_t num;
+	size_t size;
+	uint64_t next_id;		/* first scroll-back line not searched */
+
+	/* shadow of the line being searched */
+	char *text;
+	unsigned int *cols;		/* cell of every byte of text */
+	size_t text_size;
+	unsigned int *spans;		/* matches as [start, end) cells */
+	size_t spans_size;
+};
+
+#ifdef __SSE2__
+
+/*
+ * Compare the first and last byte of @needle at 16 positions at once and only
+ * check the rest where both match. Lines are short, so this beats the generic
+ * memmem() which needs to set up its tables for every line.
+ */
+static const char *search_memmem(const char *hay, size_t len,
+				 const char *needle, size_t nlen)
+{
+	__m128i first, last, a, b;
+	unsigned int mask, bit;
+	size_t i;
+
+	if (nlen > len)
+		return NULL;
+	if (nlen == 1)
+		return memchr(hay, needle[0], len);
+
+	first = _mm_set1_epi8(needle[0]);
+	last = _mm_set1_epi8(needle[nlen - 1]);
+
+	for (i = 0; i + nlen - 1 + 16 <= len; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(hay + i));
+		b = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+						       _mm_cmpeq_epi8(b, last)));
+		while (mask) {
+			bit = __builtin_ctz(mask);
+			if (!memcmp(hay + i + bit + 1, needle + 1, nlen - 2))
+				return hay + i + bit;
+			mask &= mask - 1;
+		}
+	}
+
+	for ( ; i + nlen <= len; ++i) {
+		if (hay[i] == needle[0] && !memcmp(hay + i, needle, nlen))
+			return hay + i;
+	}
+
+	return NULL;
+}
+
+#else /* !__SSE2__ */
+
+static const char *search_memmem(const char *hay, size_t len,
+				 const char *needle, size_t nlen)
+{
+	const char *p, *end;
+
+	if (nlen > len)
+		return NULL;
+
+	end = hay + len - nlen + 1;
+	for (p = hay; (p = memchr(p, needle[0], end - p)); ++p) {
+		if (!memcmp(p, needle, nlen))
+			return p;
+	}
+
+	return NULL;
+}
+
+#endif /* __SSE2__ */
+
+static char search_lower(char c)
+{
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/* build the shadow of @line; blank cells at its end are dropped */
+static int search_shadow(struct tsm_screen *con, const struct line *line,
+			 size_t *out)
+{
+	struct screen_search *s = con->search;
+	unsigned int x, end, n, k;
+	const uint32_t *ucs4;
+	tsm_symbol_t ch;
+	size_t len, size, i;
+	unsigned int *cols;
+	char *text, c;
+	bool lower;
+
+	for (end = line->size; end > 0; --end) {
+		if (line->cells[end - 1].ch && line->cells[end - 1].width)
+			break;
+	}
+
+	size = (size_t)end * TSM_UCS4_MAXLEN * 4 + 1;
+	if (size > s->text_size) {
+		text = realloc(s->text, size);
+		if (!text)
+			return -ENOMEM;
+		s->text = text;
+		cols = realloc(s->cols, size * sizeof(*cols));
+		if (!cols)
+			return -ENOMEM;
+		s->cols = cols;
+		s->text_size = size;
+	}
+
+	/* regcomp() handles REG_ICASE itself */
+	lower = s->flags & TSM_SCREEN_SEARCH_ICASE &&
+		!(s->flags & TSM_SCREEN_SEARCH_REGEX);
+	text = s->text;
+	cols = s->cols;
+
+	len = 0;
+	for (x = 0; x < end; ++x) {
+		if (!line->cells[x].width)
+			continue;
+
+		ch = line->cells[x].ch;
+		if (ch < 0x80) {
+			c = ch;
+			cols[len] = x;
+			text[len++] = !c ? ' ' : lower ? search_lower(c) : c;
+			continue;
+		}
+
+		ucs4 = tsm_symbol_get(con->sym_table, &ch, &i);
+		for (k = 0; k < i; ++k) {
+			n = tsm_ucs4_to_utf8(ucs4[k], &text[len]);
+			while (n--) {
+				if (lower)
+					text[len] = search_lower(text[len]);
+				cols[len++] = x;
+			}
+		}
+	}
+
+	text[len] = 0;
+	*out = len;
+	return 0;
+}
+
+static int search_add_span(struct screen_search *s, unsigned int *num,
+			   unsigned int start, unsigned int end)
+{
+	unsigned int *tmp;
+	size_t size;
+
+	if ((*num + 1) * 2 > s->spans_size) {
+		size = s->spans_size ? s->spans_size * 2 : 32;
+		tmp = realloc(s->spans, size * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		s->spans = tmp;
+		s->spans_size = size;
+	}
+
+	s->spans[*num * 2] = start;
+	s->spans[*num * 2 + 1] = end;
+	++*num;
+	return 0;
+}
+
+/*
+ * Store the matches on @line in the span buffer of the search as pairs of
+ * [start, end) cells and return their number or a negative error code.
+ */
+static int search_line(struct tsm_screen *con, const struct line *line)
+{
+	struct screen_search *s = con->search;
+	const char *hit;
+	unsigned int num = 0, last;
+	size_t len, off, b, e;
+	regmatch_t m;
+	int ret;
+
+	ret = search_shadow(con, line, &len);
+	if (ret)
+		return ret;
+
+	for (off = 0; off < len; off = e) {
+		if (s->flags & TSM_SCREEN_SEARCH_REGEX) {
+			if (regexec(&s->re, s->text + off, 1, &m,
+				    off ? REG_NOTBOL : 0))
+				break;
+			b = off + m.rm_so;
+			e = off + m.rm_eo;
+			/* empty matches are not shown */
+			if (b == e) {
+				e = b + 1;
+				continue;
+			}
+		} else {
+			hit = search_memmem(s->text + off, len - off,
+					    s->pattern, s->pattern_len);
+			if (!hit)
+				break;
+			b = hit - s->text;
+			e = b + s->pattern_len;
+		}
+
+		last = s->cols[e - 1];
+		ret = search_add_span(s, &num, s->cols[b],
+				      last + line->cells[last].width);
+		if (ret)
+			return ret;
+	}
+
+	return num;
+}
+
+static int search_add_match(struct screen_search *s, uint64_t id,
+			    unsigned int x, unsigned int cells)
+{
+	struct tsm_screen_match *tmp;
+	size_t size;
+
+	if (s->num >= s->size) {
+		/* reuse the room of matches on dropped lines first */
+		if (s->first && s->first >= s->num / 2) {
+			memmove(s->matches, &s->matches[s->first],
+				(s->num - s->first) * sizeof(*s->matches));
+			s->num -= s->first;
+			s->sb_num -= s->first;
+			s->first = 0;
+		}
+	}
+
+	if (s->num >= s->size) {
+		size = s->size ? s->size * 2 : 64;
+		tmp = realloc(s->matches, size * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		s->matches = tmp;
+		s->size = size;
+	}
+
+	s->matches[s->num].id = id;
+	s->matches[s->num].x = x;
+	s->matches[s->num].cells = cells;
+	++s->num;
+	return 0;
+}
+
+static int search_add_line(struct tsm_screen *con, const struct line *line,
+			   uint64_t id)
+{
+	struct screen_search *s = con->search;
+	int ret, num, i;
+
+	num = search_line(con, line);
+	if (num < 0)
+		return num;
+
+	for (i = 0; i < num; ++i) {
+		ret = search_add_match(s, id, s->spans[i * 2],
+				       s->spans[i * 2 + 1] - s->spans[i * 2]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* search the scroll-back lines pushed and the screen since the last update */
+static int search_update(struct tsm_screen *con)
+{
+	struct screen_search *s = con->search;
+	uint64_t id;
+	unsigned int i;
+	int ret;
+
+	/* forget the matches on dropped lines and on the screen */
+	while (s->first < s->sb_num &&
+	       (!con->sb_count || s->matches[s->first].id < con->sb_first_id))
+		++s->first;
+	s->num = s->sb_num;
+
+	id = s->next_id;
+	if (con->sb_count && id < con->sb_first_id)
+		id = con->sb_first_id;
+	for ( ; con->sb_count && id <= con->sb_last_id; ++id) {
+		ret = search_add_line(con, screen_sb_line(con,
+						id - con->sb_first_id), id);
+		if (ret)
+			return ret;
+		s->next_id = id + 1;
+		s->sb_num = s->num;
+	}
+	if (s->next_id <= con->sb_last_id)
+		s->next_id = con->sb_last_id + 1;
+
+	for (i = 0; i < con->size_y; ++i) {
+		ret = search_add_line(con, con->lines[i],
+				      con->sb_last_id + 1 + i);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+void screen_search_free(struct tsm_screen *con)
+{
+	struct screen_search *s = con->search;
+
+	if (!s)
+		return;
+
+	if (s->flags & TSM_SCREEN_SEARCH_REGEX)
+		regfree(&s->re);
+	free(s->pattern);
+	free(s->matches);
+	free(s->text);
+	free(s->cols);
+	free(s->spans);
+	free(s);
+	con->search = NULL;
+}
+
+/*
+ * Return the matches on @line as pairs of [start, end) cells in @spans. The
+ * spans are valid until the next call.
+ */
+unsigned int screen_search_spans(struct tsm_screen *con,
+				 const struct line *line,
+				 const unsigned int **spans)
+{
+	int num;
+
+	if (!con->search)
+		return 0;
+
+	num = search_line(con, line);
+	if (num < 0)
+		return 0;
+
+	*spans = con->search->spans;
+	return num;
+}
+
+SHL_EXPORT
+int tsm_screen_search(struct tsm_screen *con, const char *pattern,
+		      unsigned int flags)
+{
+	struct screen_search *s;
+	size_t i;
+	int ret;
+
+	if (!con)
+		return -EINVAL;
+
+	/* matches are only drawn by tsm_screen_draw_runs(), which follows the
+	 * damage; ages stay untouched */
+	screen_search_free(con);
+	screen_damage_all(con);
+
+	if (!pattern || !*pattern)
+		return 0;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->flags = flags & (TSM_SCREEN_SEARCH_REGEX | TSM_SCREEN_SEARCH_ICASE);
+	s->pattern = strdup(pattern);
+	if (!s->pattern) {
+		free(s);
+		return -ENOMEM;
+	}
+	s->pattern_len = strlen(pattern);
+
+	if (s->flags & TSM_SCREEN_SEARCH_REGEX) {
+		if (regcomp(&s->re, pattern, REG_EXTENDED |
+			    (s->flags & TSM_SCREEN_SEARCH_ICASE ?
+			     REG_ICASE : 0))) {
+			free(s->pattern);
+			free(s);
+			return -EINVAL;
+		}
+	} else if (s->flags & TSM_SCREEN_SEARCH_ICASE) {
+		for (i = 0; i < s->pattern_len; ++i)
+			s->pattern[i] = search_lower(s->pattern[i]);
+	}
+
+	con->search = s;
+	ret = search_update(con);
+	if (ret) {
+		llog_warning(con, "cannot search: %d", ret);
+		screen_search_free(con);
+	}
+
+	return ret;
+}
+
+SHL_EXPORT
+int tsm_screen_search_get_matches(struct tsm_screen *con,
+				  const struct tsm_screen_match **matches,
+				  size_t *num)
+{
+	struct screen_search *s;
+	int ret;
+
+	if (!con || !matches || !num)
+		return -EINVAL;
+
+	s = con->search;
+	if (!s) {
+		*matches = NULL;
+		*num = 0;
+		return -ENOENT;
+	}
+
+	ret = search_update(con);
+	if (ret)
+		return ret;
+
+	*matches = &s->matches[s->first];
+	*num = s->num - s->first;
+	return 0;
+}
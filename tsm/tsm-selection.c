@@ -52,9 +52,12 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "libtsm.h"
 #include "libtsm-int.h"
 #include "shl-llog.h"
@@ -64,23 +67,29 @@
 static void selection_set(struct tsm_screen *con, struct selection_pos *sel,
 			  unsigned int x, unsigned int y)
 {
-	struct line *pos;
+	unsigned int num = 0;
 
 	sel->line = NULL;
-	pos = con->sb_pos;
-
-	while (y && pos) {
-		--y;
-		pos = pos->next;
+	if (con->sb_scrolled)
+		num = con->sb_count - con->sb_pos_num;
+
+	if (y < num) {
+		sel->line = screen_sb_line(con, con->sb_pos_num + y);
+		y = 0;
+	} else {
+		y -= num;
 	}
 
-	if (pos)
-		sel->line = pos;
-
 	sel->x = x;
 	sel->y = y;
 }
 
+/* scroll-back lines may be shorter than the screen; the rest is blank */
+static tsm_symbol_t line_ch(const struct line *line, unsigned int x)
+{
+	return x < line->size ? line->cells[x].ch : 0;
+}
+
 static void word_select(struct tsm_screen *con,
 			unsigned int posx,
 			unsigned int posy)
@@ -95,11 +104,11 @@ static void word_select(struct tsm_screen *con,
 	else
 	 	line = con->lines[con->sel_start.y];
 
-	if (!line || line->cells[posx].ch == ' ')
+	if (!line || line_ch(line, posx) == ' ')
 		return;
 
 	for (start = posx; start >= 0; start--) {
-		if (line->cells[start].ch == ' ') {
+		if (line_ch(line, start) == ' ') {
 			start++;
 			break;
 		}
@@ -107,9 +116,9 @@ static void word_select(struct tsm_screen *con,
 	if (start < 0)
 		start = 0;
 
-	for (end = posx; end < line->size; end++) {
-		if (line->cells[end].ch == ' ' || line->cells[end].ch == '\n' ||
-		    line->cells[end].ch == '\0') {
+	for (end = posx; end < con->size_x; end++) {
+		if (line_ch(line, end) == ' ' || line_ch(line, end) == '\n' ||
+		    line_ch(line, end) == '\0') {
 			end--;
 			break;
 		}
@@ -128,6 +137,7 @@ void tsm_screen_selection_reset(struct tsm_screen *con)
 	screen_inc_age(con);
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
+	screen_damage_all(con);
 
 	con->sel_active = false;
 }
@@ -143,6 +153,7 @@ void tsm_screen_selection_start(struct tsm_screen *con,
 	screen_inc_age(con);
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
+	screen_damage_all(con);
 
 	con->sel_active = true;
 	selection_set(con, &con->sel_start, posx, posy);
@@ -160,6 +171,7 @@ void tsm_screen_selection_target(struct tsm_screen *con,
 	screen_inc_age(con);
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
+	screen_damage_all(con);
 
 	selection_set(con, &con->sel_end, posx, posy);
 }
@@ -175,6 +187,7 @@ void tsm_screen_selection_word(struct tsm_screen *con,
 	screen_inc_age(con);
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
+	screen_damage_all(con);
 
 	word_select(con, posx, posy);
 }
@@ -186,7 +199,7 @@ static unsigned int calc_line_len(struct line *line)
 	int i;
 
 	for (i = 0; i < line->size; i++) {
-		if (line->cells[i].ch != 0) {
+		if (line->cells[i].ch != 0 && line->cells[i].width) {
 			line_len = i + 1;
 		}
 	}
@@ -194,37 +207,92 @@ static unsigned int calc_line_len(struct line *line)
 	return line_len;
 }
 
-/* TODO: tsm_ucs4_to_utf8 expects UCS4 characters, but a cell contains a
- * tsm-symbol (which can contain multiple UCS4 chars). Fix this when introducing
- * support for combining characters. */
-static unsigned int copy_line(struct line *line, char *buf,
-			      unsigned int start, unsigned int len)
+/*
+ * Exported text is collected in a small buffer that is handed to the callback
+ * whenever it fills up, so exporting never needs memory proportional to the
+ * exported lines. Line breaks are held back until the next non-empty line so
+ * trailing empty lines can be dropped.
+ */
+#define EXPORT_BUF_LEN 4096
+
+struct export_buf {
+	struct tsm_screen *con;
+	tsm_screen_export_cb cb;
+	void *data;
+	int ret;			/* first error of the callback */
+	unsigned int breaks;		/* line breaks not written yet */
+	bool text;			/* any characters exported */
+	size_t len;
+	char buf[EXPORT_BUF_LEN];
+};
+
+static void export_flush(struct export_buf *out)
 {
-	unsigned int i, end;
-	char *pos = buf;
-	int line_len;
+	if (out->len && !out->ret)
+		out->ret = out->cb(out->con, out->buf, out->len, out->data);
+	out->len = 0;
+}
 
-	line_len = calc_line_len(line);
-	if (start > line_len) {
-		return 0;
+/* make room for @n bytes */
+static void export_reserve(struct export_buf *out, size_t n)
+{
+	if (out->len + n > EXPORT_BUF_LEN)
+		export_flush(out);
+}
+
+static void export_breaks(struct export_buf *out, unsigned int num)
+{
+	for ( ; num; --num) {
+		export_reserve(out, 1);
+		out->buf[out->len++] = '\n';
 	}
+}
 
-	end = start + len;
+/*
+ * Export @len cells of @line starting at @start, followed by a line break.
+ * Blank cells past the last character are dropped, the continuation cells of
+ * wide characters are skipped.
+ */
+static void export_line(struct export_buf *out, struct line *line,
+			unsigned int start, unsigned int len)
+{
+	unsigned int i, end;
+	const uint32_t *ucs4;
+	tsm_symbol_t ch;
+	size_t n, j;
+
+	/* a selection starting in the blanks at the end of a line does not
+	 * select the line break either */
+	end = calc_line_len(line);
+	if (start > end)
+		return;
+	if (end - start > len)
+		end = start + len;
 
-	if (end > line_len) {
-		end = line_len;
+	if (start < end) {
+		export_breaks(out, out->breaks);
+		out->breaks = 0;
+		out->text = true;
 	}
 
-	for (i = start; i < line->size && i < end; ++i) {
-		if (i < line->size || !line->cells[i].ch)
-			pos += tsm_ucs4_to_utf8(line->cells[i].ch, pos);
-		else
-			pos += tsm_ucs4_to_utf8(' ', pos);
-	}
+	for (i = start; i < end; ++i) {
+		if (!line->cells[i].width)
+			continue;
 
-	pos += tsm_ucs4_to_utf8('\n', pos);
+		export_reserve(out, TSM_UCS4_MAXLEN * 4);
+		ch = line->cells[i].ch;
+		if (!ch) {
+			out->buf[out->len++] = ' ';
+			continue;
+		}
+
+		ucs4 = tsm_symbol_get(out->con->sym_table, &ch, &n);
+		for (j = 0; j < n; ++j)
+			out->len += tsm_ucs4_to_utf8(ucs4[j],
+						     &out->buf[out->len]);
+	}
 
-	return pos - buf;
+	++out->breaks;
 }
 
 static void swap_selections(struct selection_pos **a, struct selection_pos **b)
@@ -241,16 +309,19 @@ static void swap_selections(struct selection_pos **a, struct selection_pos **b)
  *
  * Start must always point to the top left and end to the bottom right cell
  */
-static void norm_selection(struct tsm_screen *con, struct selection_pos **start, struct selection_pos **end)
+static void norm_selection(struct selection_pos **start, struct selection_pos **end)
 {
-	struct line *iter;
-
 	if ((*end)->line == NULL && (*end)->y == SELECTION_TOP) {
 		swap_selections(start, end);
 
 		return;
 	}
 
+	/* start above the scroll back buffer is always first */
+	if ((*start)->line == NULL && (*start)->y == SELECTION_TOP) {
+		return;
+	}
+
 	if ((*start)->line && (*end)->line) {
 		/* single line selection */
 		if ((*start)->line == (*end)->line) {
@@ -261,20 +332,9 @@ static void norm_selection(struct tsm_screen *con, struct selection_pos **start,
 			return;
 		}
 
-		/*
-		 * multi line selection
-		 *
-		 * search from end->line to con->sb_last
-		 * if we find start->line on the way we
-		 * need to change start and end
-		*/
-		iter = (*end)->line;
-		while (iter && iter != con->sb_last) {
-			if (iter == (*start)->line) {
-				swap_selections(start, end);
-			}
-
-			iter = iter->next;
+		/* multi line selection: lines are ordered by their sb id */
+		if ((*start)->line->sb_id > (*end)->line->sb_id) {
+			swap_selections(start, end);
 		}
 
 		return;
@@ -301,50 +361,6 @@ static void norm_selection(struct tsm_screen *con, struct selection_pos **start,
 	}
 }
 
-/*
- * Counts the lines a normalized selection selects on the scroll back buffer
- *
- * Does not count the lines selected on the screen
- */
-static int selection_count_lines_sb(struct tsm_screen *con, struct selection_pos *start, struct selection_pos *end)
-{
-	struct line *iter;
-	int count = 0;
-
-	/* Single line selection */
-	if (start->line && (start->line == end->line)) {
-		return 1;
-	}
-
-	iter = start->line;
-	while (iter) {
-		count++;
-
-		if (iter == con->sb_last) {
-			break;
-		}
-
-		iter = iter->next;
-	}
-
-	return count;
-}
-
-/*
- * Counts the lines a normalized selection selects on the screen
- *
- * Does not count the lines selected in the scroll back buffer
- */
-static int selection_count_lines(struct selection_pos *start, struct selection_pos *end)
-{
-	/* Selection only spans lines of the scroll back buffer */
-	if (start->line && end->line) {
-		return 0;
-	}
-
-	return end->y - start->y + 1;
-}
-
 /*
  * Calculate the number of selected cells in a line
  */
@@ -396,59 +412,49 @@ static int calc_selection_line_len(struct tsm_screen *con, struct selection_pos
 }
 
 /*
- * Calculate the maximum needed space for the number of lines given
- */
-static unsigned int calc_line_copy_buffer(struct tsm_screen *con, unsigned int num_lines)
-{
-	// 4 is the max size of a Unicode character
-	return con->size_x * num_lines * 4 + 1;
-}
-
-/*
- * Copy all selected lines from the scroll back buffer
+ * Export all selected lines from the scroll back buffer
  */
-static int copy_lines_sb(struct tsm_screen *con, struct selection_pos *start, struct selection_pos *end, char *buf, int pos)
+static void export_lines_sb(struct tsm_screen *con, struct selection_pos *start, struct selection_pos *end, struct export_buf *out)
 {
 	struct line *iter;
 	int line_x, line_len;
+	unsigned int i;
 
 	if (!start->line) {
-		return pos;
+		return;
 	}
 
-	iter = start->line;
-	while (iter) {
+	for (i = screen_sb_index(con, start->line); i < con->sb_count; ++i) {
+		iter = screen_sb_line(con, i);
 		line_x = 0;
 		if (iter == start->line) {
 			line_x = start->x;
 		}
 
 		line_len = calc_selection_line_len_sb(con, start, end, iter);
-		pos += copy_line(iter, &(buf[pos]), line_x, line_len);
+		export_line(out, iter, line_x, line_len);
 
-		if (iter == con->sb_last || iter == end->line) {
+		if (iter == end->line) {
 			break;
 		}
-
-		iter = iter->next;
 	}
-
-	return pos;
 }
 
 /*
- * Copy all selected lines from the regular screen
+ * Export all selected lines from the regular screen
  */
-static int copy_lines(struct tsm_screen *con, struct selection_pos *start, struct selection_pos *end, char *buf, int pos)
+static void export_lines(struct tsm_screen *con, struct selection_pos *start, struct selection_pos *end, struct export_buf *out)
 {
 	int line_len, line_x, i;
 
 	/* selection is scroll back buffer only */
 	if (end->line) {
-		return pos;
+		return;
 	}
 
-	for (i = start->y; i <= end->y; i++) {
+	/* a selection starting in the scroll back buffer continues at the
+	 * top of the screen, its y is not a screen row */
+	for (i = start->line ? 0 : start->y; i <= end->y; i++) {
 		line_len = calc_selection_line_len(con, start, end, i);
 
 		line_x = 0;
@@ -456,22 +462,20 @@ static int copy_lines(struct tsm_screen *con, struct selection_pos *start, struc
 			line_x = start->x;
 		}
 
-		pos += copy_line(con->lines[i], &(buf[pos]), line_x, line_len);
+		export_line(out, con->lines[i], line_x, line_len);
 	}
-
-	return pos;
 }
 
 SHL_EXPORT
-int tsm_screen_selection_copy(struct tsm_screen *con, char **out)
+int tsm_screen_selection_export(struct tsm_screen *con,
+				tsm_screen_export_cb cb, void *data)
 {
 	struct selection_pos *start, *end;
 	struct selection_pos start_copy, end_copy;
-	int buf_size = 0;
-	int pos = 0;
-	int total_lines;
+	struct export_buf *out;
+	int ret;
 
-	if (!con || !out) {
+	if (!con || !cb) {
 		return -EINVAL;
 	}
 
@@ -491,15 +495,14 @@ int tsm_screen_selection_copy(struct tsm_screen *con, char **out)
 	/* invalid selection */
 	if (start->y == SELECTION_TOP && start->line == NULL &&
 		end->y == SELECTION_TOP && end->line == NULL) {
-		*out = strdup("");
 		return 0;
 	}
 
-	norm_selection(con, &start, &end);
+	norm_selection(&start, &end);
 
 	if (start->line == NULL && start->y == SELECTION_TOP) {
-		if (con->sb_first != NULL) {
-			start->line = con->sb_first;
+		if (con->sb_count) {
+			start->line = screen_sb_line(con, 0);
 			start->x = 0;
 		} else {
 			start->y = 0;
@@ -507,22 +510,164 @@ int tsm_screen_selection_copy(struct tsm_screen *con, char **out)
 		}
 	}
 
-	total_lines =  selection_count_lines_sb(con, start, end);
-	total_lines += selection_count_lines(start, end);
-	buf_size = calc_line_copy_buffer(con, total_lines);
+	out = malloc(sizeof(*out));
+	if (!out) {
+		return -ENOMEM;
+	}
+	memset(out, 0, offsetof(struct export_buf, buf));
+	out->con = con;
+	out->cb = cb;
+	out->data = data;
+
+	export_lines_sb(con, start, end, out);
+	export_lines(con, start, end, out);
+
+	/* drop the last line break, keep selected empty lines before it */
+	if (out->breaks) {
+		export_breaks(out, out->breaks - 1);
+	}
+	export_flush(out);
+
+	ret = out->ret;
+	free(out);
+	return ret;
+}
+
+/*
+ * Export the scroll back buffer followed by the main screen, both with their
+ * full width. The result ends with a single line break.
+ */
+SHL_EXPORT
+int tsm_screen_history_export(struct tsm_screen *con,
+			      tsm_screen_export_cb cb, void *data)
+{
+	struct export_buf *out;
+	unsigned int i;
+	int ret;
 
-	*out = calloc(buf_size, 1);
-	if (!*out) {
+	if (!con || !cb) {
+		return -EINVAL;
+	}
+
+	out = malloc(sizeof(*out));
+	if (!out) {
 		return -ENOMEM;
 	}
+	memset(out, 0, offsetof(struct export_buf, buf));
+	out->con = con;
+	out->cb = cb;
+	out->data = data;
+
+	for (i = 0; i < con->sb_count && !out->ret; ++i) {
+		export_line(out, screen_sb_line(con, i), 0, UINT_MAX);
+	}
+
+	for (i = 0; i < con->size_y && !out->ret; ++i) {
+		export_line(out, con->main_lines[i], 0, con->size_x);
+	}
+
+	/* trailing empty lines are dropped */
+	if (out->text) {
+		export_breaks(out, 1);
+	}
+	export_flush(out);
+
+	ret = out->ret;
+	free(out);
+	return ret;
+}
+
+static int write_fd(struct tsm_screen *con, const char *u8, size_t len,
+		    void *data)
+{
+	int fd = *(int *)data;
+	ssize_t ret;
 
-	pos = copy_lines_sb(con, start, end, *out, pos);
-	pos = copy_lines(con, start, end, *out, pos);
+	(void)con;
 
-	/* remove last line break */
-	if (pos > 0) {
-		(*out)[--pos] = '\0';
+	while (len) {
+		ret = write(fd, u8, len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		u8 += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+SHL_EXPORT
+int tsm_screen_history_write(struct tsm_screen *con, int fd)
+{
+	if (fd < 0) {
+		return -EINVAL;
+	}
+
+	return tsm_screen_history_export(con, write_fd, &fd);
+}
+
+struct copy_buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static int copy_append(struct tsm_screen *con, const char *u8, size_t len,
+		       void *data)
+{
+	struct copy_buf *buf = data;
+	size_t size;
+	char *tmp;
+
+	(void)con;
+
+	if (buf->len + len >= buf->size) {
+		size = buf->size ? buf->size : EXPORT_BUF_LEN;
+		while (size <= buf->len + len) {
+			size *= 2;
+		}
+
+		tmp = realloc(buf->data, size);
+		if (!tmp) {
+			return -ENOMEM;
+		}
+		buf->data = tmp;
+		buf->size = size;
+	}
+
+	memcpy(&buf->data[buf->len], u8, len);
+	buf->len += len;
+	buf->data[buf->len] = '\0';
+	return 0;
+}
+
+SHL_EXPORT
+int tsm_screen_selection_copy(struct tsm_screen *con, char **out)
+{
+	struct copy_buf buf = { NULL, 0, 0 };
+	int ret;
+
+	if (!con || !out) {
+		return -EINVAL;
+	}
+
+	ret = tsm_screen_selection_export(con, copy_append, &buf);
+	if (ret) {
+		free(buf.data);
+		return ret;
+	}
+
+	if (!buf.data) {
+		buf.data = strdup("");
+		if (!buf.data) {
+			return -ENOMEM;
+		}
 	}
 
-	return pos;
+	*out = buf.data;
+	return buf.len;
 }
@@ -57,11 +57,13 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "wcwidth.h"
 #include "libtsm.h"
 #include "libtsm-int.h"
 #include "shl-array.h"
-#include "shl-htable.h"
 
 /*
  * Unicode Symbol Handling
@@ -83,69 +85,275 @@
  * a valid UCS4 value, though. But no memory management is needed as all
  * tsm_symbol_t objects are simple integers.
  *
- * The symbol table contains two-way
- * references. The Hash Table contains all the symbols with the symbol ucs4
- * string as key and the symbol ID as value.
- * The index array contains the symbol ID as key and a pointer to the ucs4
- * string as value. But the hash table owns the ucs4 string.
- * This allows fast implementations of *_get() and *_append() without long
- * search intervals.
+ * The symbol table contains two-way references. An open-addressing hash table
+ * maps the ucs4 string of a symbol to its ID and the index array maps the ID
+ * back to the string. The strings themselves are packed into pages owned by
+ * the table so they never move and need no allocation of their own.
+ * Hash slots carry the full hash and, for the common case of a base character
+ * with a single mark, the string itself so probing rarely touches the pages.
+ * The index array also caches the cell width of each symbol so writing it
+ * does not need to decompose it again.
  *
  * When creating a new symbol, we simply return the UCS4 value as new symbol. We
  * do not add it to our symbol table as it is only one character. However, if a
  * character is appended to an existing symbol, we create a new ucs4 string and
  * push the new symbol into the symbol table.
+ *
+ * Symbols are never freed one by one. Instead, the owner of the table marks the
+ * symbols that are still in use and tsm_symbol_table_collect() rebuilds the
+ * table with only those, renumbering them.
  */
 
 const tsm_symbol_t tsm_symbol_default = 0;
 
+#define SYMBOL_SLOTS_MIN 64		/* initial number of hash slots */
+#define SYMBOL_PAGE_SIZE 4096		/* code points per string page */
+
+struct symbol_slot {
+	uint32_t hash;
+	uint32_t id;			/* 0 for a free slot */
+	uint32_t key[2];		/* string of length 2, else invalid */
+};
+
+struct symbol_entry {
+	const uint32_t *key;
+	unsigned int width;
+};
+
 struct tsm_symbol_table {
 	unsigned long ref;
 	uint32_t next_id;
 	struct shl_array *index;
-	struct shl_htable symbols;
+
+	struct symbol_slot *slots;
+	size_t slot_mask;
+	size_t slot_used;
+
+	struct shl_array *pages;
+	uint32_t *page;
+	size_t page_used;
 };
 
-static size_t hash_ucs4(const void *key, void *priv)
+static uint32_t hash_ucs4(const uint32_t *ucs4, size_t len)
 {
-	size_t i, val = 5381;
-	const uint32_t *ucs4 = key;
+	uint32_t h = 0x9e3779b9 ^ len;
+	size_t i;
 
-	for (i = 0; ucs4[i] <= TSM_UCS4_MAX; ++i)
-		val = val * 33 + ucs4[i];
+	for (i = 0; i < len; ++i) {
+		h ^= ucs4[i];
+		h *= 0x85ebca6b;
+		h = h << 13 | h >> 19;
+	}
 
-	return val;
+	/* murmur3 finalizer */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
 }
 
-static bool cmp_ucs4(const void *a, const void *b)
+static const uint32_t *symbol_key(struct tsm_symbol_table *tbl, uint32_t id)
 {
-	size_t i;
-	const uint32_t *v1, *v2;
+	return SHL_ARRAY_AT(tbl->index, struct symbol_entry,
+			    id - (TSM_UCS4_MAX + 1))->key;
+}
 
-	v1 = a;
-	v2 = b;
+static bool slot_match(struct tsm_symbol_table *tbl,
+		       const struct symbol_slot *slot, uint32_t hash,
+		       const uint32_t *ucs4, size_t len)
+{
+	const uint32_t *key;
+	size_t i;
 
-	for (i = 0; ; ++i) {
-		if (v1[i] > TSM_UCS4_MAX && v2[i] > TSM_UCS4_MAX)
-			return true;
-		if (v1[i] != v2[i])
+	if (slot->hash != hash)
+		return false;
+	if (len == 2)
+		return slot->key[0] == ucs4[0] && slot->key[1] == ucs4[1];
+	if (slot->key[0] <= TSM_UCS4_MAX)
+		return false;
+
+	/* stops at the terminator of a shorter key */
+	key = symbol_key(tbl, slot->id);
+	for (i = 0; i < len; ++i) {
+		if (key[i] != ucs4[i])
 			return false;
 	}
+
+	return key[len] > TSM_UCS4_MAX;
+}
+
+/* returns the slot holding @ucs4 or the free slot to insert it into */
+static struct symbol_slot *symbol_find(struct tsm_symbol_table *tbl,
+				       uint32_t hash, const uint32_t *ucs4,
+				       size_t len)
+{
+	struct symbol_slot *slot;
+	size_t i;
+
+	for (i = hash & tbl->slot_mask; ; i = (i + 1) & tbl->slot_mask) {
+		slot = &tbl->slots[i];
+		if (!slot->id || slot_match(tbl, slot, hash, ucs4, len))
+			return slot;
+	}
 }
 
-static void free_ucs4(void *elem, void *priv)
+/* double the number of slots; the load factor is kept below 3/4 */
+static int symbol_grow(struct tsm_symbol_table *tbl)
 {
-	uint32_t *v = elem;
+	struct symbol_slot *slots, *old;
+	size_t i, j, num, mask;
+
+	num = tbl->slot_mask + 1;
+	slots = calloc(num * 2, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+
+	old = tbl->slots;
+	mask = num * 2 - 1;
+	for (i = 0; i < num; ++i) {
+		if (!old[i].id)
+			continue;
+		for (j = old[i].hash & mask; slots[j].id; j = (j + 1) & mask)
+			/* empty */ ;
+		slots[j] = old[i];
+	}
 
-	/* key is prefix with actual value so pass correct pointer */
-	free(--v);
+	free(old);
+	tbl->slots = slots;
+	tbl->slot_mask = mask;
+	return 0;
+}
+
+/* copy @len code points plus terminator into the string pages */
+static uint32_t *symbol_store(struct tsm_symbol_table *tbl,
+			      const uint32_t *ucs4, size_t len)
+{
+	uint32_t *page, *key;
+	int ret;
+
+	if (!tbl->page || tbl->page_used + len + 1 > SYMBOL_PAGE_SIZE) {
+		page = malloc(sizeof(*page) * SYMBOL_PAGE_SIZE);
+		if (!page)
+			return NULL;
+		ret = shl_array_push(tbl->pages, &page);
+		if (ret) {
+			free(page);
+			return NULL;
+		}
+		tbl->page = page;
+		tbl->page_used = 0;
+	}
+
+	key = &tbl->page[tbl->page_used];
+	memcpy(key, ucs4, len * sizeof(*ucs4));
+	key[len] = TSM_UCS4_MAX + 1;
+	tbl->page_used += len + 1;
+	return key;
+}
+
+static int symbol_table_init(struct tsm_symbol_table *tbl)
+{
+	int ret;
+	static const struct symbol_entry val; /* we need a valid lvalue */
+
+	memset(tbl, 0, sizeof(*tbl));
+	tbl->next_id = TSM_UCS4_MAX + 2;
+
+	tbl->slots = calloc(SYMBOL_SLOTS_MIN, sizeof(*tbl->slots));
+	if (!tbl->slots)
+		return -ENOMEM;
+	tbl->slot_mask = SYMBOL_SLOTS_MIN - 1;
+
+	ret = shl_array_new(&tbl->pages, sizeof(uint32_t*), 4);
+	if (ret)
+		goto err_slots;
+
+	ret = shl_array_new(&tbl->index, sizeof(struct symbol_entry), 4);
+	if (ret)
+		goto err_pages;
+
+	/* first entry is not used so add dummy */
+	shl_array_push(tbl->index, &val);
+	return 0;
+
+err_pages:
+	shl_array_free(tbl->pages);
+err_slots:
+	free(tbl->slots);
+	return ret;
+}
+
+static void symbol_table_release(struct tsm_symbol_table *tbl)
+{
+	size_t i;
+
+	for (i = 0; i < shl_array_get_length(tbl->pages); ++i)
+		free(*SHL_ARRAY_AT(tbl->pages, uint32_t*, i));
+	shl_array_free(tbl->pages);
+	shl_array_free(tbl->index);
+	free(tbl->slots);
+}
+
+/*
+ * Add the new symbol @ucs4 of length @len whose hash is @hash. @slot is the
+ * free slot symbol_find() returned for it. Returns the new ID or 0 on failure.
+ */
+static uint32_t symbol_add(struct tsm_symbol_table *tbl,
+			   struct symbol_slot *slot, uint32_t hash,
+			   const uint32_t *ucs4, size_t len)
+{
+	struct symbol_entry entry;
+	uint32_t nsym;
+	int ret;
+
+	/* index 0 is the dummy entry, so IDs start at TSM_UCS4_MAX + 2 */
+	nsym = tbl->next_id;
+	/* Out of IDs; we actually have 2 Billion IDs so this seems
+	 * very unlikely but lets be safe here */
+	if (nsym < TSM_UCS4_MAX + 2)
+		return 0;
+
+	if ((tbl->slot_used + 1) * 4 > (tbl->slot_mask + 1) * 3) {
+		ret = symbol_grow(tbl);
+		if (ret)
+			return 0;
+		slot = symbol_find(tbl, hash, ucs4, len);
+	}
+
+	entry.key = symbol_store(tbl, ucs4, len);
+	if (!entry.key)
+		return 0;
+
+	/* the base character decides the width of the whole symbol */
+	entry.width = tsm_ucs4_get_width(ucs4[0]);
+	ret = shl_array_push(tbl->index, &entry);
+	if (ret) {
+		tbl->page_used -= len + 1;
+		return 0;
+	}
+
+	slot->hash = hash;
+	slot->id = nsym;
+	if (len == 2) {
+		slot->key[0] = ucs4[0];
+		slot->key[1] = ucs4[1];
+	} else {
+		slot->key[0] = TSM_UCS4_MAX + 1;
+		slot->key[1] = TSM_UCS4_MAX + 1;
+	}
+	++tbl->slot_used;
+	++tbl->next_id;
+
+	return nsym;
 }
 
 int tsm_symbol_table_new(struct tsm_symbol_table **out)
 {
 	struct tsm_symbol_table *tbl;
 	int ret;
-	static const uint32_t *val = NULL; /* we need a valid lvalue */
 
 	if (!out)
 		return -EINVAL;
@@ -153,24 +361,16 @@ int tsm_symbol_table_new(struct tsm_symbol_table **out)
 	tbl = malloc(sizeof(*tbl));
 	if (!tbl)
 		return -ENOMEM;
-	memset(tbl, 0, sizeof(*tbl));
-	tbl->ref = 1;
-	tbl->next_id = TSM_UCS4_MAX + 2;
-	shl_htable_init(&tbl->symbols, cmp_ucs4, hash_ucs4, NULL);
 
-	ret = shl_array_new(&tbl->index, sizeof(uint32_t*), 4);
-	if (ret)
-		goto err_free;
-
-	/* first entry is not used so add dummy */
-	shl_array_push(tbl->index, &val);
+	ret = symbol_table_init(tbl);
+	if (ret) {
+		free(tbl);
+		return ret;
+	}
 
+	tbl->ref = 1;
 	*out = tbl;
 	return 0;
-
-err_free:
-	free(tbl);
-	return ret;
 }
 
 void tsm_symbol_table_ref(struct tsm_symbol_table *tbl)
@@ -186,11 +386,85 @@ void tsm_symbol_table_unref(struct tsm_symbol_table *tbl)
 	if (!tbl || !tbl->ref || --tbl->ref)
 		return;
 
-	shl_htable_clear(&tbl->symbols, free_ucs4, NULL);
-	shl_array_free(tbl->index);
+	symbol_table_release(tbl);
 	free(tbl);
 }
 
+/* number of composed symbols in @tbl and the memory they take */
+void tsm_symbol_table_get_stats(struct tsm_symbol_table *tbl,
+				unsigned int *num, size_t *bytes)
+{
+	unsigned int n = 0;
+	size_t b = 0;
+
+	if (tbl) {
+		n = shl_array_get_length(tbl->index) - 1;
+		b = sizeof(*tbl);
+		b += (tbl->slot_mask + 1) * sizeof(*tbl->slots);
+		b += shl_array_get_length(tbl->index) *
+		     sizeof(struct symbol_entry);
+		b += shl_array_get_length(tbl->pages) *
+		     (sizeof(uint32_t*) + SYMBOL_PAGE_SIZE * sizeof(uint32_t));
+	}
+
+	if (num)
+		*num = n;
+	if (bytes)
+		*bytes = b;
+}
+
+/*
+ * Drop every composed symbol that is not marked in @map. @map has one entry
+ * per index of the table, see TSM_SYMBOL_INDEX(), and a symbol is kept if its
+ * entry is non-zero. The kept symbols are renumbered in order and, on success,
+ * their entries in @map are replaced by their new IDs so the caller can rewrite
+ * its cells. Existing IDs stay valid if this fails.
+ */
+int tsm_symbol_table_collect(struct tsm_symbol_table *tbl, uint32_t *map)
+{
+	struct tsm_symbol_table tmp;
+	struct symbol_entry *entry;
+	struct symbol_slot *slot;
+	uint32_t hash, nsym;
+	size_t i, len, num;
+	int ret;
+
+	if (!tbl || !map)
+		return -EINVAL;
+
+	ret = symbol_table_init(&tmp);
+	if (ret)
+		return ret;
+
+	num = shl_array_get_length(tbl->index);
+	for (i = 1; i < num; ++i) {
+		if (!map[i])
+			continue;
+
+		entry = SHL_ARRAY_AT(tbl->index, struct symbol_entry, i);
+		for (len = 0; entry->key[len] <= TSM_UCS4_MAX; ++len)
+			/* empty */ ;
+
+		hash = hash_ucs4(entry->key, len);
+		slot = symbol_find(&tmp, hash, entry->key, len);
+		if (!symbol_add(&tmp, slot, hash, entry->key, len)) {
+			symbol_table_release(&tmp);
+			return -ENOMEM;
+		}
+	}
+
+	nsym = TSM_UCS4_MAX + 2;
+	for (i = 1; i < num; ++i) {
+		if (map[i])
+			map[i] = nsym++;
+	}
+
+	symbol_table_release(tbl);
+	tmp.ref = tbl->ref;
+	*tbl = tmp;
+	return 0;
+}
+
 tsm_symbol_t tsm_symbol_make(uint32_t ucs4)
 {
 	if (ucs4 > TSM_UCS4_MAX)
@@ -205,7 +479,7 @@ tsm_symbol_t tsm_symbol_make(uint32_t ucs4)
  * Therefore, the returned value may get destroyed if your \sym argument gets
  * destroyed.
  * If \sym is a composed ucs4 string, then the returned value points into the
- * hash table of the symbol table and lives as long as the symbol table does.
+ * string pages of the symbol table and lives as long as the symbol table does.
  *
  * This always returns a valid value. If an error happens, the default character
  * is returned. If \size is NULL, then the size value is omitted.
@@ -213,7 +487,8 @@ tsm_symbol_t tsm_symbol_make(uint32_t ucs4)
 const uint32_t *tsm_symbol_get(struct tsm_symbol_table *tbl,
 			       tsm_symbol_t *sym, size_t *size)
 {
-	uint32_t *ucs4, idx;
+	const uint32_t *ucs4;
+	uint32_t idx;
 
 	if (*sym <= TSM_UCS4_MAX) {
 		if (size)
@@ -228,7 +503,7 @@ const uint32_t *tsm_symbol_get(struct tsm_symbol_table *tbl,
 	if (idx >= shl_array_get_length(tbl->index))
 		ucs4 = NULL;
 	else
-		ucs4 = *SHL_ARRAY_AT(tbl->index, uint32_t*, idx);
+		ucs4 = SHL_ARRAY_AT(tbl->index, struct symbol_entry, idx)->key;
 
 	if (!ucs4) {
 		if (size)
@@ -248,11 +523,10 @@ const uint32_t *tsm_symbol_get(struct tsm_symbol_table *tbl,
 tsm_symbol_t tsm_symbol_append(struct tsm_symbol_table *tbl,
 			       tsm_symbol_t sym, uint32_t ucs4)
 {
-	uint32_t buf[TSM_UCS4_MAXLEN + 1], nsym, *nval;
+	uint32_t buf[TSM_UCS4_MAXLEN + 1], hash, nsym;
+	struct symbol_slot *slot;
 	const uint32_t *ptr;
 	size_t s;
-	bool res;
-	int ret;
 
 	if (!tbl)
 		return sym;
@@ -266,65 +540,32 @@ tsm_symbol_t tsm_symbol_append(struct tsm_symbol_table *tbl,
 
 	memcpy(buf, ptr, s * sizeof(uint32_t));
 	buf[s++] = ucs4;
-	buf[s++] = TSM_UCS4_MAX + 1;
-
-	res = shl_htable_lookup(&tbl->symbols, buf, hash_ucs4(buf, NULL),
-				(void**)&nval);
-	if (res) {
-		/* key is prefixed with actual value */
-		return *--nval;
-	}
 
-	/* We save the key in nval and prefix it with the new ID. Note that
-	 * the prefix is hidden, we actually store "++nval" in the htable. */
-	nval = malloc(sizeof(uint32_t) * (s + 1));
-	if (!nval)
-		return sym;
-
-	++nval;
-	memcpy(nval, buf, s * sizeof(uint32_t));
-
-	nsym = tbl->next_id + 1;
-	/* Out of IDs; we actually have 2 Billion IDs so this seems
-	 * very unlikely but lets be safe here */
-	if (nsym <= tbl->next_id++)
-		goto err_id;
+	hash = hash_ucs4(buf, s);
+	slot = symbol_find(tbl, hash, buf, s);
+	if (slot->id)
+		return slot->id;
 
-	/* store ID hidden before the key */
-	*(nval - 1) = nsym;
-
-	ret = shl_htable_insert(&tbl->symbols, nval, hash_ucs4(nval, NULL));
-	if (ret)
-		goto err_id;
-
-	ret = shl_array_push(tbl->index, &nval);
-	if (ret)
-		goto err_symbol;
-
-	return nsym;
-
-err_symbol:
-	shl_htable_remove(&tbl->symbols, nval, hash_ucs4(nval, NULL), NULL);
-err_id:
-	--tbl->next_id;
-	free(nval);
-	return sym;
+	nsym = symbol_add(tbl, slot, hash, buf, s);
+	return nsym ? nsym : sym;
 }
 
 unsigned int tsm_symbol_get_width(struct tsm_symbol_table *tbl,
 				  tsm_symbol_t sym)
 {
-	const uint32_t *ch;
-	size_t len;
+	uint32_t idx;
 
 	if (!tbl)
 		return 0;
 
-	ch = tsm_symbol_get(tbl, &sym, &len);
-	if (len == 0)
+	if (sym <= TSM_UCS4_MAX)
+		return tsm_ucs4_get_width(sym);
+
+	idx = sym - (TSM_UCS4_MAX + 1);
+	if (idx >= shl_array_get_length(tbl->index))
 		return 0;
 
-	return tsm_ucs4_get_width(*ch);
+	return SHL_ARRAY_AT(tbl->index, struct symbol_entry, idx)->width;
 }
 
 SHL_EXPORT
@@ -578,3 +819,131 @@ void tsm_utf8_mach_reset(struct tsm_utf8_mach *mach)
 
 	mach->state = TSM_UTF8_START;
 }
+
+/* Returns true if the machine is not in the middle of a multi-byte sequence,
+ * that is, the next byte is parsed as the start of a new character. */
+bool tsm_utf8_mach_is_idle(struct tsm_utf8_mach *mach)
+{
+	if (!mach)
+		return true;
+
+	return mach->state != TSM_UTF8_EXPECT1 &&
+	       mach->state != TSM_UTF8_EXPECT2 &&
+	       mach->state != TSM_UTF8_EXPECT3;
+}
+
+/*
+ * Block decoder
+ * tsm_utf8_mach_decode() decodes a whole buffer into @out, which must have room
+ * for @len characters. The result is identical to feeding each byte via
+ * tsm_utf8_mach_feed() and storing tsm_utf8_mach_get() whenever the machine
+ * reports TSM_UTF8_ACCEPT or TSM_UTF8_REJECT. Sequences that are split across
+ * buffers are kept in the machine and completed by the next call.
+ * Runs of ASCII are widened 16 bytes at a time and complete multi-byte
+ * sequences are decoded in one step; only incomplete or invalid sequences go
+ * through the byte-wise state machine so its error recovery is preserved.
+ */
+
+static inline bool utf8_is_cont(const char *in, size_t i)
+{
+	return ((unsigned char)in[i] & 0xC0) == 0x80;
+}
+
+static size_t utf8_decode_ascii(const char *in, size_t len, uint32_t *out)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, lo, hi;
+	unsigned int mask;
+
+	for ( ; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i*)(in + i));
+		mask = _mm_movemask_epi8(v);
+		if (mask)
+			break;
+
+		lo = _mm_unpacklo_epi8(v, zero);
+		hi = _mm_unpackhi_epi8(v, zero);
+		_mm_storeu_si128((__m128i*)(out + i),
+				 _mm_unpacklo_epi16(lo, zero));
+		_mm_storeu_si128((__m128i*)(out + i + 4),
+				 _mm_unpackhi_epi16(lo, zero));
+		_mm_storeu_si128((__m128i*)(out + i + 8),
+				 _mm_unpacklo_epi16(hi, zero));
+		_mm_storeu_si128((__m128i*)(out + i + 12),
+				 _mm_unpackhi_epi16(hi, zero));
+	}
+
+#endif
+
+	for ( ; i < len && !(in[i] & 0x80); ++i)
+		out[i] = in[i];
+
+	return i;
+}
+
+size_t tsm_utf8_mach_decode(struct tsm_utf8_mach *mach, const char *in,
+			    size_t len, uint32_t *out)
+{
+	size_t i = 0, n = 0, num;
+	uint32_t c;
+	int state;
+
+	if (!mach || !in || !out)
+		return 0;
+
+	while (i < len) {
+		if (tsm_utf8_mach_is_idle(mach)) {
+			num = utf8_decode_ascii(in + i, len - i, out + n);
+			if (num) {
+				i += num;
+				n += num;
+				mach->ch = out[n - 1];
+				mach->state = TSM_UTF8_ACCEPT;
+				continue;
+			}
+
+			/* tsm_utf8_mach_feed() sign-extends the input before
+			 * its overlong check, so 0xC0 and 0xC1 start two-byte
+			 * sequences like any other lead byte. Do the same. */
+			c = (unsigned char)in[i];
+			if ((c & 0xE0) == 0xC0 && i + 1 < len &&
+			    utf8_is_cont(in, i + 1)) {
+				mach->ch = (c & 0x1F) << 6 |
+					   (in[i + 1] & 0x3F);
+				i += 2;
+			} else if ((c & 0xF0) == 0xE0 && i + 2 < len &&
+				   utf8_is_cont(in, i + 1) &&
+				   utf8_is_cont(in, i + 2)) {
+				mach->ch = (c & 0x0F) << 12 |
+					   (in[i + 1] & 0x3F) << 6 |
+					   (in[i + 2] & 0x3F);
+				i += 3;
+			} else if ((c & 0xF8) == 0xF0 && i + 3 < len &&
+				   utf8_is_cont(in, i + 1) &&
+				   utf8_is_cont(in, i + 2) &&
+				   utf8_is_cont(in, i + 3)) {
+				mach->ch = (c & 0x07) << 18 |
+					   (in[i + 1] & 0x3F) << 12 |
+					   (in[i + 2] & 0x3F) << 6 |
+					   (in[i + 3] & 0x3F);
+				i += 4;
+			} else {
+				goto feed;
+			}
+
+			mach->state = TSM_UTF8_ACCEPT;
+			out[n++] = mach->ch;
+			continue;
+		}
+
+feed:
+		state = tsm_utf8_mach_feed(mach, in[i++]);
+		if (state == TSM_UTF8_ACCEPT || state == TSM_UTF8_REJECT)
+			out[n++] = tsm_utf8_mach_get(mach);
+	}
+
+	return n;
+}
@@ -52,10 +52,15 @@
 #include <string.h>
 #include "libtsm.h"
 #include "libtsm-int.h"
+#include "grapheme.h"
 #include "shl-llog.h"
 
 #include <xkbcommon/xkbcommon-keysyms.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #define LLOG_SUBSYSTEM "tsm-vte"
 
 /* Input parser states */
@@ -114,8 +119,22 @@ enum parser_action {
 /* max CSI arguments */
 #define CSI_ARG_MAX 16
 
-/* max length of an OSC code */
-#define OSC_MAX_LEN 128
+/* default max length of a buffered OSC payload; longer payloads are cut */
+#define OSC_MAX_LEN (1 << 20)
+
+/* initial OSC buffer size; buffers grown past OSC_KEEP_LEN are given back
+ * once the sequence is done */
+#define OSC_INIT_LEN 128
+#define OSC_KEEP_LEN 4096
+
+/* size of the chunks passed to the OSC chunk callback */
+#define OSC_CHUNK_LEN (64 * 1024)
+
+/* max number of printable symbols batched before writing them to the screen */
+#define PRINT_MAX_LEN 128
+
+/* max number of input bytes decoded from UTF-8 in one step */
+#define UTF8_DECODE_LEN 256
 
 /* terminal flags */
 #define FLAG_CURSOR_KEY_MODE			0x00000001 /* DEC cursor key mode */
@@ -167,8 +186,20 @@ struct tsm_vte {
 
 	tsm_vte_osc_cb osc_cb;
 	void *osc_data;
-	unsigned int osc_len;
-	char osc_arg[OSC_MAX_LEN];
+	tsm_vte_osc_chunk_cb osc_chunk_cb;
+	void *osc_chunk_data;
+	char *osc_buf;			/* OSC payload, NUL-terminated on end */
+	size_t osc_len;
+	size_t osc_size;		/* allocated size of osc_buf */
+	size_t osc_max;			/* max buffered payload length */
+	bool osc_streamed;		/* first chunk was already passed on */
+	bool osc_truncated;		/* payload was cut at osc_max */
+
+	unsigned int print_len;
+	tsm_symbol_t print_buf[PRINT_MAX_LEN];
+	tsm_symbol_t last_sym;		/* last printed symbol for REP; 0 if none */
+	enum tsm_grapheme cluster;	/* break property of the last code point
+					 * printed; CONTROL if no cluster is open */
 
 	tsm_vte_mouse_cb mouse_cb;
 	void *mouse_data;
@@ -180,7 +211,7 @@ struct tsm_vte {
 	uint8_t (*custom_palette_storage)[3];
 	uint8_t (*palette)[3];
 	struct tsm_screen_attr def_attr;
-	struct tsm_screen_attr cattr;
+	struct tsm_screen_attr cattr;	/* colors always resolved to RGB */
 	unsigned int flags;
 
 	tsm_vte_charset **gl;
@@ -480,6 +511,7 @@ int tsm_vte_new(struct tsm_vte **out, struct tsm_screen *con,
 	vte->backspace_sends_delete = false;
 	vte->osc_cb = NULL;
 	vte->osc_data = NULL;
+	vte->osc_max = OSC_MAX_LEN;
 	vte->mouse_cb = NULL;
 	vte->mouse_data = NULL;
 	vte->custom_palette_storage = NULL;
@@ -488,9 +520,16 @@ int tsm_vte_new(struct tsm_vte **out, struct tsm_screen *con,
 	vte->def_attr.bccode = TSM_COLOR_BACKGROUND;
 	to_rgb(vte, &vte->def_attr);
 
+	vte->osc_size = OSC_INIT_LEN;
+	vte->osc_buf = malloc(vte->osc_size);
+	if (!vte->osc_buf) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
 	ret = tsm_utf8_mach_new(&vte->mach);
 	if (ret)
-		goto err_free;
+		goto err_osc;
 
 	tsm_vte_reset(vte);
 	tsm_screen_erase_screen(vte->con, false);
@@ -500,6 +539,8 @@ int tsm_vte_new(struct tsm_vte **out, struct tsm_screen *con,
 	*out = vte;
 	return 0;
 
+err_osc:
+	free(vte->osc_buf);
 err_free:
 	free(vte);
 	return ret;
@@ -528,6 +569,7 @@ void tsm_vte_unref(struct tsm_vte *vte)
 	tsm_screen_unref(vte->con);
 	tsm_utf8_mach_free(vte->mach);
 	free(vte->custom_palette_storage);
+	free(vte->osc_buf);
 	free(vte);
 }
 
@@ -541,6 +583,27 @@ void tsm_vte_set_osc_cb(struct tsm_vte *vte, tsm_vte_osc_cb osc_cb, void *osc_da
 	vte->osc_data = osc_data;
 }
 
+SHL_EXPORT
+void tsm_vte_set_osc_chunk_cb(struct tsm_vte *vte, tsm_vte_osc_chunk_cb cb,
+			      void *data)
+{
+	if (!vte)
+		return;
+
+	vte->osc_chunk_cb = cb;
+	vte->osc_chunk_data = data;
+}
+
+SHL_EXPORT
+int tsm_vte_set_osc_max_len(struct tsm_vte *vte, size_t max)
+{
+	if (!vte || !max)
+		return -EINVAL;
+
+	vte->osc_max = max;
+	return 0;
+}
+
 SHL_EXPORT
 void tsm_vte_set_mouse_cb(struct tsm_vte *vte, tsm_vte_mouse_cb mouse_cb, void *mouse_data)
 {
@@ -715,13 +778,91 @@ static void vte_write_debug(struct tsm_vte *vte, const char *u8, size_t len,
 #define vte_write_raw(_vte, _u8, _len) \
 	vte_write_debug((_vte), (_u8), (_len), true, __FILE__, __LINE__)
 
-/* write to console */
+/*
+ * Write to console
+ * @cattr is converted via to_rgb() whenever its color codes, the bold flag or
+ * the palette change, so it can be passed to the screen layer as is.
+ */
 static void write_console(struct tsm_vte *vte, tsm_symbol_t sym)
 {
-	to_rgb(vte, &vte->cattr);
 	tsm_screen_write(vte->con, sym, &vte->cattr);
 }
 
+/*
+ * Printable characters are collected in @print_buf and written as one run as
+ * soon as any other action is performed or the input is exhausted. Nothing but
+ * ACTION_PRINT can observe the screen or change the attributes in between, so
+ * this is equivalent to writing each symbol directly.
+ */
+static void flush_console(struct tsm_vte *vte)
+{
+	if (!vte->print_len)
+		return;
+
+	tsm_screen_write_run(vte->con, vte->print_buf, vte->print_len,
+			     &vte->cattr);
+	vte->print_len = 0;
+}
+
+/*
+ * Whether a code point with break property @gb continues the grapheme cluster
+ * printed last (UAX #29 GB6-GB9). Only zero-width code points are attached,
+ * anything taking cells of its own keeps the cursor where applications using
+ * wcwidth() expect it.
+ */
+static bool vte_extends_cluster(struct tsm_vte *vte, enum tsm_grapheme gb)
+{
+	switch (gb) {
+	case TSM_GRAPHEME_EXTEND:
+	case TSM_GRAPHEME_ZWJ:
+		return vte->cluster != TSM_GRAPHEME_CONTROL;
+	case TSM_GRAPHEME_V:
+		return vte->cluster == TSM_GRAPHEME_L ||
+		       vte->cluster == TSM_GRAPHEME_V ||
+		       vte->cluster == TSM_GRAPHEME_LV;
+	case TSM_GRAPHEME_T:
+		return vte->cluster == TSM_GRAPHEME_V ||
+		       vte->cluster == TSM_GRAPHEME_T ||
+		       vte->cluster == TSM_GRAPHEME_LV ||
+		       vte->cluster == TSM_GRAPHEME_LVT;
+	default:
+		return false;
+	}
+}
+
+static void print_console(struct tsm_vte *vte, tsm_symbol_t sym)
+{
+	enum tsm_grapheme gb = TSM_GRAPHEME_OTHER;
+	tsm_symbol_t nsym;
+
+	/* nothing below U+0300 extends a cluster */
+	if (sym >= 0x300) {
+		gb = tsm_grapheme_get(sym);
+		if (vte_extends_cluster(vte, gb) &&
+		    !tsm_ucs4_get_width(sym)) {
+			flush_console(vte);
+			nsym = tsm_screen_compose(vte->con, sym);
+			if (nsym) {
+				vte->last_sym = nsym;
+				vte->cluster = gb;
+				return;
+			}
+		}
+
+		/* zero-width code points that are not attached are dropped
+		 * by the screen and leave no cell to extend */
+		if (gb == TSM_GRAPHEME_EXTEND || gb == TSM_GRAPHEME_ZWJ ||
+		    gb == TSM_GRAPHEME_V || gb == TSM_GRAPHEME_T)
+			gb = tsm_ucs4_get_width(sym) ? gb : TSM_GRAPHEME_CONTROL;
+	}
+
+	vte->cluster = gb;
+	vte->last_sym = sym;
+	vte->print_buf[vte->print_len++] = sym;
+	if (vte->print_len >= PRINT_MAX_LEN)
+		flush_console(vte);
+}
+
 static void reset_state(struct tsm_vte *vte)
 {
 	vte->saved_state.cursor_x = 0;
@@ -817,6 +958,9 @@ void tsm_vte_reset(struct tsm_vte *vte)
 	vte->mouse_last_col = 0;
 	vte->mouse_last_row = 0;
 
+	vte->last_sym = 0;
+	vte->cluster = TSM_GRAPHEME_CONTROL;
+
 	memcpy(&vte->cattr, &vte->def_attr, sizeof(vte->cattr));
 	to_rgb(vte, &vte->cattr);
 	tsm_screen_set_def_attr(vte->con, &vte->def_attr);
@@ -960,7 +1104,24 @@ static void do_clear(struct tsm_vte *vte)
 	vte->csi_flags = 0;
 
 	vte->osc_len = 0;
-	memset(vte->osc_arg, 0, sizeof(vte->osc_arg));
+}
+
+/* start a new OSC payload; gives back the memory of a previous large one */
+static void do_osc_start(struct tsm_vte *vte)
+{
+	char *tmp;
+
+	vte->osc_len = 0;
+	vte->osc_streamed = false;
+	vte->osc_truncated = false;
+
+	if (vte->osc_size > OSC_KEEP_LEN) {
+		tmp = realloc(vte->osc_buf, OSC_INIT_LEN);
+		if (tmp) {
+			vte->osc_buf = tmp;
+			vte->osc_size = OSC_INIT_LEN;
+		}
+	}
 }
 
 static void do_collect(struct tsm_vte *vte, uint32_t data)
@@ -1257,11 +1418,85 @@ static void lookup_color(struct tsm_vte *vte, int color, uint8_t *cr,
 	}
 }
 
+/*
+ * Fast path for the most common SGR forms: reset, 256-color and true-color
+ * foreground/background. Returns false if the generic parser is needed. The
+ * result is the same as running the generic parser on these arguments.
+ */
+static bool csi_attribute_fast(struct tsm_vte *vte)
+{
+	const int *argv = vte->csi_argv;
+	struct tsm_screen_attr *attr = &vte->cattr;
+
+	switch (vte->csi_argc) {
+	case 1:
+		if (argv[0] != -1 && argv[0] != 0)
+			return false;
+
+		copy_fcolor(attr, &vte->def_attr);
+		copy_bcolor(attr, &vte->def_attr);
+		attr->bold = 0;
+		attr->italic = 0;
+		attr->underline = 0;
+		attr->inverse = 0;
+		attr->blink = 0;
+		return true;
+	case 3:
+		if (argv[1] != 5 || argv[2] < 0)
+			return false;
+
+		if (argv[0] == 38) {
+			if (argv[2] < 16) {
+				attr->fccode = argv[2];
+			} else {
+				attr->fccode = -1;
+				lookup_color(vte, argv[2], &attr->fr,
+					     &attr->fg, &attr->fb);
+			}
+		} else if (argv[0] == 48) {
+			if (argv[2] < 16) {
+				attr->bccode = argv[2];
+			} else {
+				attr->bccode = -1;
+				lookup_color(vte, argv[2], &attr->br,
+					     &attr->bg, &attr->bb);
+			}
+		} else {
+			return false;
+		}
+		return true;
+	case 5:
+		if (argv[1] != 2 || argv[2] < 0 || argv[3] < 0 ||
+		    argv[4] < 0)
+			return false;
+
+		if (argv[0] == 38) {
+			attr->fccode = -1;
+			attr->fr = argv[2];
+			attr->fg = argv[3];
+			attr->fb = argv[4];
+		} else if (argv[0] == 48) {
+			attr->bccode = -1;
+			attr->br = argv[2];
+			attr->bg = argv[3];
+			attr->bb = argv[4];
+		} else {
+			return false;
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
 static void csi_attribute(struct tsm_vte *vte)
 {
 	unsigned int i, code, val;
 	uint8_t cr, cg, cb;
 
+	if (csi_attribute_fast(vte))
+		goto out;
+
 	if (vte->csi_argc <= 1 && vte->csi_argv[0] == -1) {
 		vte->csi_argc = 1;
 		vte->csi_argv[0] = 0;
@@ -1467,6 +1702,7 @@ static void csi_attribute(struct tsm_vte *vte)
 		}
 	}
 
+out:
 	to_rgb(vte, &vte->cattr);
 	if (vte->flags & TSM_VTE_FLAG_BACKGROUND_COLOR_ERASE_MODE)
 		tsm_screen_set_def_attr(vte->con, &vte->cattr);
@@ -1720,6 +1956,16 @@ static void csi_mode(struct tsm_vte *vte, bool set)
 						   vte->alt_cursor_y);
 			}
 			continue;
+		case 2026: /* Synchronized output */
+			/* The screen is updated as usual; the flag only tells
+			 * renderers to hold back the frame until it is reset. */
+			if (set)
+				tsm_screen_set_flags(vte->con,
+						     TSM_SCREEN_SYNC_UPDATE);
+			else
+				tsm_screen_reset_flags(vte->con,
+						       TSM_SCREEN_SYNC_UPDATE);
+			continue;
 		case TSM_VTE_MOUSE_EVENT_BTN:
 		case TSM_VTE_MOUSE_EVENT_ANY:
 			if (vte->mouse_mode == TSM_VTE_MOUSE_MODE_X10) {
@@ -1764,6 +2010,25 @@ static void csi_mode(struct tsm_vte *vte, bool set)
 	}
 }
 
+static void csi_decrqm(struct tsm_vte *vte)
+{
+	char buf[32];
+	unsigned int len;
+	bool set;
+
+	/* Only synchronized output is reported so applications can probe for
+	 * it; other modes are still ignored. */
+	if (!(vte->csi_flags & CSI_WHAT) || vte->csi_argv[0] != 2026) {
+		llog_debug(vte, "unhandled DECRQM %d", vte->csi_argv[0]);
+		return;
+	}
+
+	set = tsm_screen_get_flags(vte->con) & TSM_SCREEN_SYNC_UPDATE;
+	len = snprintf(buf, sizeof(buf), "\e[?%d;%d$y", vte->csi_argv[0],
+		       set ? 1 : 2);
+	vte_write(vte, buf, len);
+}
+
 static void csi_dev_attr(struct tsm_vte *vte)
 {
 	if (vte->csi_argc <= 1 && vte->csi_argv[0] <= 0) {
@@ -1940,12 +2205,7 @@ static void do_csi(struct tsm_vte *vte, uint32_t data)
 			csi_soft_reset(vte);
 		} else if (vte->csi_flags & CSI_CASH) {
 			/* DECRQM: Request DEC Private Mode */
-			/* If CSI_WHAT is set, then enable,
-			 * otherwise disable */
-
-			/* Ignore */
-
-			/* FIXME: Implement DECRQM */
+			csi_decrqm(vte);
 		} else {
 			/* DECSCL: Compatibility Level */
 			/* Sometimes CSI_DQUOTE is set here, too */
@@ -2003,6 +2263,15 @@ static void do_csi(struct tsm_vte *vte, uint32_t data)
 			num = 1;
 		tsm_screen_insert_chars(vte->con, num);
 		break;
+	case 'b': /* REP */
+		/* repeat the preceding graphic character */
+		num = vte->csi_argv[0];
+		if (num <= 0)
+			num = 1;
+		if (vte->last_sym)
+			tsm_screen_write_repeat(vte->con, vte->last_sym, num,
+						&vte->cattr);
+		break;
 	case 'P': /* DCH */
 		/* delete characters */
 		num = vte->csi_argv[0];
@@ -2073,15 +2342,86 @@ static uint32_t vte_map(struct tsm_vte *vte, uint32_t val)
 	return val;
 }
 
+/* pass the buffered OSC data to the chunk callback and empty the buffer */
+static void osc_flush_chunk(struct tsm_vte *vte, unsigned int flags)
+{
+	if (!vte->osc_streamed)
+		flags |= TSM_VTE_OSC_BEGIN;
+	vte->osc_streamed = true;
+
+	vte->osc_buf[vte->osc_len] = 0;
+	vte->osc_chunk_cb(vte, vte->osc_buf, vte->osc_len, flags,
+			  vte->osc_chunk_data);
+	vte->osc_len = 0;
+}
+
+/* make room for @len more payload bytes plus the terminating NUL */
+static bool osc_reserve(struct tsm_vte *vte, size_t len)
+{
+	size_t size;
+	char *tmp;
+
+	if (vte->osc_len + len < vte->osc_size)
+		return true;
+
+	size = vte->osc_size;
+	while (size <= vte->osc_len + len)
+		size *= 2;
+
+	tmp = realloc(vte->osc_buf, size);
+	if (!tmp) {
+		llog_warning(vte, "cannot grow OSC buffer to %zu bytes", size);
+		return false;
+	}
+
+	vte->osc_buf = tmp;
+	vte->osc_size = size;
+	return true;
+}
+
+/*
+ * Append payload data to the current OSC sequence. With a chunk callback the
+ * buffer is passed on every OSC_CHUNK_LEN bytes so payloads of any size go
+ * through a fixed amount of memory, otherwise it grows up to osc_max and the
+ * rest is dropped. @len is either a single character or plain ASCII, so data
+ * is only ever split between ASCII bytes.
+ */
+static void osc_append(struct tsm_vte *vte, const char *data, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = len;
+		if (vte->osc_chunk_cb) {
+			if (vte->osc_len + n > OSC_CHUNK_LEN) {
+				if (vte->osc_len)
+					osc_flush_chunk(vte, 0);
+				if (n > OSC_CHUNK_LEN)
+					n = OSC_CHUNK_LEN;
+			}
+		} else if (vte->osc_len + n > vte->osc_max) {
+			if (!vte->osc_truncated)
+				llog_debug(vte, "OSC payload longer than %zu bytes, dropping the rest",
+					   vte->osc_max);
+			vte->osc_truncated = true;
+			return;
+		}
+
+		if (!osc_reserve(vte, n))
+			return;
+
+		memcpy(vte->osc_buf + vte->osc_len, data, n);
+		vte->osc_len += n;
+		data += n;
+		len -= n;
+	}
+}
+
 static void do_osc_collect(struct tsm_vte *vte, uint32_t val) {
 	char buf[4];
 	int len = tsm_ucs4_to_utf8(val, buf);
-	if (vte->osc_len + len > sizeof(vte->osc_arg) - 1) {
-		return;
-	}
 
-	memcpy(vte->osc_arg + vte->osc_len, buf, len);
-	vte->osc_len += len;
+	osc_append(vte, buf, len);
 }
 
 static void vte_write_xcolor(struct tsm_vte *vte, char *code,
@@ -2137,17 +2477,17 @@ static bool do_osc_internal(struct tsm_vte *vte, const char *end_seq)
 	// 4-bit (SGR 90-97 & 100-107), and 256-color (SGR 38;5 & 48;5) indexed
 	// color tables. We don't support changing the tables, but we do support
 	// querying them.
-	if (!strncmp(vte->osc_arg, "4;", 2)) {
-		do_osc_4(vte, vte->osc_arg + 2, end_seq);
+	if (!strncmp(vte->osc_buf, "4;", 2)) {
+		do_osc_4(vte, vte->osc_buf + 2, end_seq);
 		return true;
 	}
-	if (!strncmp(vte->osc_arg, "10;?", 4)) {
+	if (!strncmp(vte->osc_buf, "10;?", 4)) {
 		vte_write_xcolor(vte, "10", end_seq,
 				 vte->def_attr.fr, vte->def_attr.fg,
 				 vte->def_attr.fb);
 		return true;
 	}
-	if (!strncmp(vte->osc_arg, "11;?", 4)) {
+	if (!strncmp(vte->osc_buf, "11;?", 4)) {
 		vte_write_xcolor(vte, "11", end_seq,
 				 vte->def_attr.br, vte->def_attr.bg,
 				 vte->def_attr.bb);
@@ -2167,15 +2507,19 @@ static const char *osc_end_seq(uint32_t end)
 
 static void do_osc_end(struct tsm_vte *vte, uint32_t val) {
 	const char *end_seq = osc_end_seq(val);
-	vte->osc_arg[vte->osc_len] = 0;
+	vte->osc_buf[vte->osc_len] = 0;
 
-	if (do_osc_internal(vte, end_seq)) {
+	if (!vte->osc_streamed && do_osc_internal(vte, end_seq)) {
+		return;
+	}
+	if (vte->osc_chunk_cb) {
+		osc_flush_chunk(vte, TSM_VTE_OSC_END);
 		return;
 	}
 	if (!vte->osc_cb) {
 		return;
 	}
-	vte->osc_cb(vte, vte->osc_arg, vte->osc_len, vte->osc_data);
+	vte->osc_cb(vte, vte->osc_buf, vte->osc_len, vte->osc_data);
 }
 
 /* perform parser action */
@@ -2183,6 +2527,11 @@ static void do_action(struct tsm_vte *vte, uint32_t data, int action)
 {
 	tsm_symbol_t sym;
 
+	if (action != ACTION_PRINT) {
+		flush_console(vte);
+		vte->cluster = TSM_GRAPHEME_CONTROL;
+	}
+
 	switch (action) {
 		case ACTION_NONE:
 			/* do nothing */
@@ -2192,7 +2541,7 @@ static void do_action(struct tsm_vte *vte, uint32_t data, int action)
 			break;
 		case ACTION_PRINT:
 			sym = tsm_symbol_make(vte_map(vte, data));
-			write_console(vte, sym);
+			print_console(vte, sym);
 			break;
 		case ACTION_EXECUTE:
 			do_execute(vte, data);
@@ -2220,6 +2569,7 @@ static void do_action(struct tsm_vte *vte, uint32_t data, int action)
 			break;
 		case ACTION_OSC_START:
 			do_clear(vte);
+			do_osc_start(vte);
 			break;
 		case ACTION_OSC_COLLECT:
 			do_osc_collect(vte, data);
@@ -2267,6 +2617,219 @@ static void do_trans(struct tsm_vte *vte, uint32_t data, int state, int act)
 	}
 }
 
+/*
+ * Input byte classes
+ * The parser does not care about the exact value of most input characters. All
+ * characters of a class trigger the same transition in every state, so the
+ * state machine below only needs one column per class. Everything above 0x9f
+ * falls into CLASS_HIGH.
+ */
+enum parser_class {
+	CLASS_C0,		/* C0 controls without special meaning */
+	CLASS_BEL,		/* BEL; terminates OSC strings */
+	CLASS_EXECUTE,		/* CAN, SUB, ST and most C1 controls */
+	CLASS_ESC,		/* ESC */
+	CLASS_SOS,		/* SOS, PM and APC */
+	CLASS_DCS,		/* DCS */
+	CLASS_CSI,		/* CSI */
+	CLASS_OSC,		/* OSC */
+	CLASS_INTERMEDIATE,	/* intermediate characters 0x20-0x2f */
+	CLASS_PARAM,		/* digits and ';' */
+	CLASS_COLON,		/* ':' */
+	CLASS_PRIVATE,		/* private markers 0x3c-0x3f */
+	CLASS_FINAL,		/* final characters 0x40-0x7e not listed below */
+	CLASS_ESC_DCS,		/* 'P' */
+	CLASS_ESC_SOS,		/* 'X', '^' and '_' */
+	CLASS_ESC_CSI,		/* '[' */
+	CLASS_ESC_OSC,		/* ']' */
+	CLASS_DEL,		/* DEL */
+	CLASS_HIGH,		/* anything above C1 */
+	CLASS_NUM
+};
+
+static const uint8_t parser_class[0xa0] = {
+	[0x00 ... 0x06] = CLASS_C0,
+	[0x07] = CLASS_BEL,
+	[0x08 ... 0x17] = CLASS_C0,
+	[0x18] = CLASS_EXECUTE,
+	[0x19] = CLASS_C0,
+	[0x1a] = CLASS_EXECUTE,
+	[0x1b] = CLASS_ESC,
+	[0x1c ... 0x1f] = CLASS_C0,
+	[0x20 ... 0x2f] = CLASS_INTERMEDIATE,
+	[0x30 ... 0x39] = CLASS_PARAM,
+	[0x3a] = CLASS_COLON,
+	[0x3b] = CLASS_PARAM,
+	[0x3c ... 0x3f] = CLASS_PRIVATE,
+	[0x40 ... 0x4f] = CLASS_FINAL,
+	[0x50] = CLASS_ESC_DCS,
+	[0x51 ... 0x57] = CLASS_FINAL,
+	[0x58] = CLASS_ESC_SOS,
+	[0x59 ... 0x5a] = CLASS_FINAL,
+	[0x5b] = CLASS_ESC_CSI,
+	[0x5c] = CLASS_FINAL,
+	[0x5d] = CLASS_ESC_OSC,
+	[0x5e ... 0x5f] = CLASS_ESC_SOS,
+	[0x60 ... 0x7e] = CLASS_FINAL,
+	[0x7f] = CLASS_DEL,
+	[0x80 ... 0x8f] = CLASS_EXECUTE,
+	[0x90] = CLASS_DCS,
+	[0x91 ... 0x97] = CLASS_EXECUTE,
+	[0x98] = CLASS_SOS,
+	[0x99 ... 0x9a] = CLASS_EXECUTE,
+	[0x9b] = CLASS_CSI,
+	[0x9c] = CLASS_EXECUTE,
+	[0x9d] = CLASS_OSC,
+	[0x9e ... 0x9f] = CLASS_SOS,
+};
+
+/* transition: new state (or STATE_NONE to stay) and action to perform */
+struct parser_trans {
+	uint8_t state;
+	uint8_t action;
+};
+
+#define TRANS(_state, _action) { STATE_ ## _state, ACTION_ ## _action }
+
+/* events that may occur in any state */
+#define TRANS_ANYWHERE \
+	[CLASS_EXECUTE] = TRANS(GROUND, EXECUTE), \
+	[CLASS_ESC] = TRANS(ESC, NONE), \
+	[CLASS_SOS] = TRANS(ST_IGNORE, NONE), \
+	[CLASS_DCS] = TRANS(DCS_ENTRY, NONE), \
+	[CLASS_OSC] = TRANS(OSC_STRING, NONE), \
+	[CLASS_CSI] = TRANS(CSI_ENTRY, NONE)
+
+/*
+ * State transition table
+ * This is the DEC/ANSI parser from vt100.net indexed by the current state and
+ * the class of the input character. An entry of { STATE_NONE, ACTION_NONE }
+ * marks unhandled input.
+ */
+static const struct parser_trans parser_table[STATE_NUM][CLASS_NUM] = {
+	[STATE_NONE] = {
+		TRANS_ANYWHERE,
+	},
+	[STATE_GROUND] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0 ... CLASS_BEL] = TRANS(NONE, EXECUTE),
+		[CLASS_INTERMEDIATE ... CLASS_HIGH] = TRANS(NONE, PRINT),
+	},
+	[STATE_ESC] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0 ... CLASS_BEL] = TRANS(NONE, EXECUTE),
+		[CLASS_INTERMEDIATE] = TRANS(ESC_INT, COLLECT),
+		[CLASS_PARAM ... CLASS_FINAL] = TRANS(GROUND, ESC_DISPATCH),
+		[CLASS_ESC_DCS] = TRANS(DCS_ENTRY, NONE),
+		[CLASS_ESC_SOS] = TRANS(ST_IGNORE, NONE),
+		[CLASS_ESC_CSI] = TRANS(CSI_ENTRY, NONE),
+		[CLASS_ESC_OSC] = TRANS(OSC_STRING, NONE),
+		[CLASS_DEL] = TRANS(NONE, IGNORE),
+		[CLASS_HIGH] = TRANS(ESC_INT, COLLECT),
+	},
+	[STATE_ESC_INT] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0 ... CLASS_BEL] = TRANS(NONE, EXECUTE),
+		[CLASS_INTERMEDIATE] = TRANS(NONE, COLLECT),
+		[CLASS_PARAM ... CLASS_ESC_OSC] = TRANS(GROUND, ESC_DISPATCH),
+		[CLASS_DEL] = TRANS(NONE, IGNORE),
+		[CLASS_HIGH] = TRANS(NONE, COLLECT),
+	},
+	[STATE_CSI_ENTRY] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0 ... CLASS_BEL] = TRANS(NONE, EXECUTE),
+		[CLASS_INTERMEDIATE] = TRANS(CSI_INT, COLLECT),
+		[CLASS_PARAM] = TRANS(CSI_PARAM, PARAM),
+		[CLASS_COLON] = TRANS(CSI_IGNORE, NONE),
+		[CLASS_PRIVATE] = TRANS(CSI_PARAM, COLLECT),
+		[CLASS_FINAL ... CLASS_ESC_OSC] = TRANS(GROUND, CSI_DISPATCH),
+		[CLASS_DEL] = TRANS(NONE, IGNORE),
+		[CLASS_HIGH] = TRANS(CSI_IGNORE, NONE),
+	},
+	[STATE_CSI_PARAM] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0 ... CLASS_BEL] = TRANS(NONE, EXECUTE),
+		[CLASS_INTERMEDIATE] = TRANS(CSI_INT, COLLECT),
+		[CLASS_PARAM] = TRANS(NONE, PARAM),
+		[CLASS_COLON ... CLASS_PRIVATE] = TRANS(CSI_IGNORE, NONE),
+		[CLASS_FINAL ... CLASS_ESC_OSC] = TRANS(GROUND, CSI_DISPATCH),
+		[CLASS_DEL] = TRANS(NONE, IGNORE),
+		[CLASS_HIGH] = TRANS(CSI_IGNORE, NONE),
+	},
+	[STATE_CSI_INT] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0 ... CLASS_BEL] = TRANS(NONE, EXECUTE),
+		[CLASS_INTERMEDIATE] = TRANS(NONE, COLLECT),
+		[CLASS_PARAM ... CLASS_PRIVATE] = TRANS(CSI_IGNORE, NONE),
+		[CLASS_FINAL ... CLASS_ESC_OSC] = TRANS(GROUND, CSI_DISPATCH),
+		[CLASS_DEL] = TRANS(NONE, IGNORE),
+		[CLASS_HIGH] = TRANS(CSI_IGNORE, NONE),
+	},
+	[STATE_CSI_IGNORE] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0 ... CLASS_BEL] = TRANS(NONE, EXECUTE),
+		[CLASS_INTERMEDIATE ... CLASS_PRIVATE] = TRANS(NONE, IGNORE),
+		[CLASS_FINAL ... CLASS_ESC_OSC] = TRANS(GROUND, NONE),
+		[CLASS_DEL ... CLASS_HIGH] = TRANS(NONE, IGNORE),
+	},
+	[STATE_DCS_ENTRY] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0 ... CLASS_BEL] = TRANS(NONE, IGNORE),
+		[CLASS_INTERMEDIATE] = TRANS(DCS_INT, COLLECT),
+		[CLASS_PARAM] = TRANS(DCS_PARAM, PARAM),
+		[CLASS_COLON] = TRANS(DCS_IGNORE, NONE),
+		[CLASS_PRIVATE] = TRANS(DCS_PARAM, COLLECT),
+		[CLASS_FINAL ... CLASS_ESC_OSC] = TRANS(DCS_PASS, NONE),
+		[CLASS_DEL] = TRANS(NONE, IGNORE),
+		[CLASS_HIGH] = TRANS(DCS_PASS, NONE),
+	},
+	[STATE_DCS_PARAM] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0 ... CLASS_BEL] = TRANS(NONE, IGNORE),
+		[CLASS_INTERMEDIATE] = TRANS(DCS_INT, COLLECT),
+		[CLASS_PARAM] = TRANS(NONE, PARAM),
+		[CLASS_COLON ... CLASS_PRIVATE] = TRANS(DCS_IGNORE, NONE),
+		[CLASS_FINAL ... CLASS_ESC_OSC] = TRANS(DCS_PASS, NONE),
+		[CLASS_DEL] = TRANS(NONE, IGNORE),
+		[CLASS_HIGH] = TRANS(DCS_PASS, NONE),
+	},
+	[STATE_DCS_INT] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0 ... CLASS_BEL] = TRANS(NONE, IGNORE),
+		[CLASS_INTERMEDIATE] = TRANS(NONE, COLLECT),
+		[CLASS_PARAM ... CLASS_PRIVATE] = TRANS(DCS_IGNORE, NONE),
+		[CLASS_FINAL ... CLASS_ESC_OSC] = TRANS(DCS_PASS, NONE),
+		[CLASS_DEL] = TRANS(NONE, IGNORE),
+		[CLASS_HIGH] = TRANS(DCS_PASS, NONE),
+	},
+	[STATE_DCS_PASS] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0 ... CLASS_BEL] = TRANS(NONE, DCS_COLLECT),
+		[CLASS_INTERMEDIATE ... CLASS_ESC_OSC] = TRANS(NONE, DCS_COLLECT),
+		[CLASS_DEL] = TRANS(NONE, IGNORE),
+		[CLASS_HIGH] = TRANS(NONE, DCS_COLLECT),
+	},
+	[STATE_DCS_IGNORE] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0 ... CLASS_BEL] = TRANS(NONE, IGNORE),
+		[CLASS_INTERMEDIATE ... CLASS_HIGH] = TRANS(NONE, IGNORE),
+	},
+	[STATE_OSC_STRING] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0] = TRANS(NONE, IGNORE),
+		[CLASS_BEL] = TRANS(GROUND, NONE),
+		[CLASS_INTERMEDIATE ... CLASS_HIGH] = TRANS(NONE, OSC_COLLECT),
+	},
+	[STATE_ST_IGNORE] = {
+		TRANS_ANYWHERE,
+		[CLASS_C0 ... CLASS_BEL] = TRANS(NONE, IGNORE),
+		[CLASS_INTERMEDIATE ... CLASS_HIGH] = TRANS(NONE, IGNORE),
+	},
+};
+
+#undef TRANS_ANYWHERE
+#undef TRANS
+
 /*
  * Escape sequence parser
  * This parses the new input character \data. It performs state transition and
@@ -2274,358 +2837,161 @@ static void do_trans(struct tsm_vte *vte, uint32_t data, int state, int act)
  */
 static void parse_data(struct tsm_vte *vte, uint32_t raw)
 {
-	/* events that may occur in any state */
-	switch (raw) {
-		case 0x18:
-		case 0x1a:
-		case 0x80 ... 0x8f:
-		case 0x91 ... 0x97:
-		case 0x99:
-		case 0x9a:
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_EXECUTE);
-			return;
-		case 0x1b:
-			do_trans(vte, raw, STATE_ESC, ACTION_NONE);
-			return;
-		case 0x98:
-		case 0x9e:
-		case 0x9f:
-			do_trans(vte, raw, STATE_ST_IGNORE, ACTION_NONE);
-			return;
-		case 0x90:
-			do_trans(vte, raw, STATE_DCS_ENTRY, ACTION_NONE);
-			return;
-		case 0x9d:
-			do_trans(vte, raw, STATE_OSC_STRING, ACTION_NONE);
-			return;
-		case 0x9b:
-			do_trans(vte, raw, STATE_CSI_ENTRY, ACTION_NONE);
-			return;
-	}
+	const struct parser_trans *t;
 
-	/* events that depend on the current state */
-	switch (vte->state) {
-	case STATE_GROUND:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x80 ... 0x8f:
-		case 0x91 ... 0x9a:
-		case 0x9c:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x20 ... 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_PRINT);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_PRINT);
-		return;
-	case STATE_ESC:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_ESC_INT, ACTION_COLLECT);
-			return;
-		case 0x30 ... 0x4f:
-		case 0x51 ... 0x57:
-		case 0x59:
-		case 0x5a:
-		case 0x5c:
-		case 0x60 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_ESC_DISPATCH);
-			return;
-		case 0x5b:
-			do_trans(vte, raw, STATE_CSI_ENTRY, ACTION_NONE);
-			return;
-		case 0x5d:
-			do_trans(vte, raw, STATE_OSC_STRING, ACTION_NONE);
-			return;
-		case 0x50:
-			do_trans(vte, raw, STATE_DCS_ENTRY, ACTION_NONE);
-			return;
-		case 0x58:
-		case 0x5e:
-		case 0x5f:
-			do_trans(vte, raw, STATE_ST_IGNORE, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_ESC_INT, ACTION_COLLECT);
-		return;
-	case STATE_ESC_INT:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_NONE, ACTION_COLLECT);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x30 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_ESC_DISPATCH);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_COLLECT);
-		return;
-	case STATE_CSI_ENTRY:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_CSI_INT, ACTION_COLLECT);
-			return;
-		case 0x3a:
-			do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-			return;
-		case 0x30 ... 0x39:
-		case 0x3b:
-			do_trans(vte, raw, STATE_CSI_PARAM, ACTION_PARAM);
-			return;
-		case 0x3c ... 0x3f:
-			do_trans(vte, raw, STATE_CSI_PARAM, ACTION_COLLECT);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_CSI_DISPATCH);
-			return;
-		}
-		do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-		return;
-	case STATE_CSI_PARAM:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x30 ... 0x39:
-		case 0x3b:
-			do_trans(vte, raw, STATE_NONE, ACTION_PARAM);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x3a:
-		case 0x3c ... 0x3f:
-			do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_CSI_INT, ACTION_COLLECT);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_CSI_DISPATCH);
-			return;
-		}
-		do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-		return;
-	case STATE_CSI_INT:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_NONE, ACTION_COLLECT);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x30 ... 0x3f:
-			do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_CSI_DISPATCH);
-			return;
-		}
-		do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-		return;
-	case STATE_CSI_IGNORE:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x20 ... 0x3f:
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-		return;
-	case STATE_DCS_ENTRY:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x3a:
-			do_trans(vte, raw, STATE_DCS_IGNORE, ACTION_NONE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_DCS_INT, ACTION_COLLECT);
-			return;
-		case 0x30 ... 0x39:
-		case 0x3b:
-			do_trans(vte, raw, STATE_DCS_PARAM, ACTION_PARAM);
-			return;
-		case 0x3c ... 0x3f:
-			do_trans(vte, raw, STATE_DCS_PARAM, ACTION_COLLECT);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-		return;
-	case STATE_DCS_PARAM:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x30 ... 0x39:
-		case 0x3b:
-			do_trans(vte, raw, STATE_NONE, ACTION_PARAM);
-			return;
-		case 0x3a:
-		case 0x3c ... 0x3f:
-			do_trans(vte, raw, STATE_DCS_IGNORE, ACTION_NONE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_DCS_INT, ACTION_COLLECT);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-		return;
-	case STATE_DCS_INT:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_NONE, ACTION_COLLECT);
-			return;
-		case 0x30 ... 0x3f:
-			do_trans(vte, raw, STATE_DCS_IGNORE, ACTION_NONE);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-		return;
-	case STATE_DCS_PASS:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x20 ... 0x7e:
-			do_trans(vte, raw, STATE_NONE, ACTION_DCS_COLLECT);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_DCS_COLLECT);
-		return;
-	case STATE_DCS_IGNORE:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x20 ... 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-		return;
-	case STATE_OSC_STRING:
-		switch (raw) {
-		case 0x00 ... 0x06:
-		case 0x08 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x20 ... 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_OSC_COLLECT);
-			return;
-		case 0x07:
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_OSC_COLLECT);
-		return;
-	case STATE_ST_IGNORE:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x20 ... 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
+	t = &parser_table[vte->state][raw < 0xa0 ? parser_class[raw] :
+							      CLASS_HIGH];
+	if (t->state == STATE_NONE && t->action == ACTION_NONE) {
+		llog_warning(vte, "unhandled input %u in state %d", raw,
+			     vte->state);
 		return;
 	}
 
-	llog_warning(vte, "unhandled input %u in state %d", raw, vte->state);
+	do_trans(vte, raw, t->state, t->action);
+}
+
+/*
+ * Printable ASCII fast path
+ * Most terminal output is plain printable ASCII. In STATE_GROUND every byte in
+ * the range 0x20-0x7e results in ACTION_PRINT without any state transition, is
+ * a complete UTF-8 character and a single-width symbol. If GL maps to the
+ * identity charset and no single-shift is pending, vte_map() is a no-op for
+ * these bytes, too. We therefore scan for runs of such bytes and write them to
+ * the screen in one go instead of pushing each byte through the parser.
+ * The scanners return the length of the leading run of bytes in 0x20-0x7e.
+ */
+
+static inline bool is_ascii_print(char c)
+{
+	return (unsigned char)c >= 0x20 && (unsigned char)c < 0x7f;
+}
+
+static size_t scan_ascii_scalar(const char *u8, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		if (!is_ascii_print(u8[i]))
+			break;
+	}
+
+	return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#ifdef __SSE2__
+static size_t scan_ascii_sse2(const char *u8, size_t len)
+{
+	const __m128i lo = _mm_set1_epi8(0x1f);
+	const __m128i hi = _mm_set1_epi8(0x7f);
+	__m128i v;
+	unsigned int mask;
+	size_t i = 0;
+
+	/* bytes >=0x80 are negative as signed chars and fail the lower bound */
+	for ( ; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i*)(u8 + i));
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, lo),
+						       _mm_cmplt_epi8(v, hi)));
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + scan_ascii_scalar(u8 + i, len - i);
+}
+#endif
+
+__attribute__((target("avx2")))
+static size_t scan_ascii_avx2(const char *u8, size_t len)
+{
+	const __m256i lo = _mm256_set1_epi8(0x1f);
+	const __m256i hi = _mm256_set1_epi8(0x7f);
+	__m256i v;
+	unsigned int mask;
+	size_t i = 0;
+
+	for ( ; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i*)(u8 + i));
+		mask = _mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpgt_epi8(v, lo),
+					 _mm256_cmpgt_epi8(hi, v)));
+		if (mask != 0xffffffff)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + scan_ascii_scalar(u8 + i, len - i);
+}
+
+static size_t scan_ascii_detect(const char *u8, size_t len);
+
+static size_t (*scan_ascii)(const char *u8, size_t len) = scan_ascii_detect;
+
+static size_t scan_ascii_detect(const char *u8, size_t len)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		scan_ascii = scan_ascii_avx2;
+	else
+#ifdef __SSE2__
+		scan_ascii = scan_ascii_sse2;
+#else
+		scan_ascii = scan_ascii_scalar;
+#endif
+
+	return scan_ascii(u8, len);
+}
+
+#else
+
+#define scan_ascii scan_ascii_scalar
+
+#endif
+
+static inline bool vte_ascii_is_plain(struct tsm_vte *vte)
+{
+	return vte->state == STATE_GROUND && !vte->glt &&
+	       *vte->gl == &tsm_vte_unicode_lower &&
+	       ((vte->flags & (TSM_VTE_FLAG_7BIT_MODE | TSM_VTE_FLAG_8BIT_MODE)) ||
+		tsm_utf8_mach_is_idle(vte->mach));
+}
+
+/* printable ASCII inside an OSC string is collected byte by byte; the same
+ * holds for whole runs of it */
+static inline bool vte_osc_is_plain(struct tsm_vte *vte)
+{
+	return vte->state == STATE_OSC_STRING &&
+	       ((vte->flags & (TSM_VTE_FLAG_7BIT_MODE | TSM_VTE_FLAG_8BIT_MODE)) ||
+		tsm_utf8_mach_is_idle(vte->mach));
 }
 
 SHL_EXPORT
 void tsm_vte_input(struct tsm_vte *vte, const char *u8, size_t len)
 {
-	int state;
-	uint32_t ucs4;
-	size_t i;
+	uint32_t ucs4[UTF8_DECODE_LEN];
+	size_t i, j, n, num;
 
 	if (!vte || !vte->con)
 		return;
 
 	++vte->parse_cnt;
-	for (i = 0; i < len; ++i) {
+	for (i = 0; i < len; i += num) {
+		if (is_ascii_print(u8[i]) && vte_ascii_is_plain(vte)) {
+			flush_console(vte);
+			num = scan_ascii(u8 + i, len - i);
+			tsm_screen_write_ascii(vte->con, u8 + i, num,
+					       &vte->cattr);
+			vte->last_sym = (unsigned char)u8[i + num - 1];
+			vte->cluster = TSM_GRAPHEME_OTHER;
+			continue;
+		}
+		if (is_ascii_print(u8[i]) && vte_osc_is_plain(vte)) {
+			num = scan_ascii(u8 + i, len - i);
+			osc_append(vte, u8 + i, num);
+			continue;
+		}
+
+		num = 1;
 		if (vte->flags & TSM_VTE_FLAG_7BIT_MODE) {
 			if (u8[i] & 0x80)
 				llog_debug(vte, "receiving 8bit character U+%d from pty while in 7bit mode",
@@ -2634,14 +3000,23 @@ void tsm_vte_input(struct tsm_vte *vte, const char *u8, size_t len)
 		} else if (vte->flags & TSM_VTE_FLAG_8BIT_MODE) {
 			parse_data(vte, u8[i]);
 		} else {
-			state = tsm_utf8_mach_feed(vte->mach, u8[i]);
-			if (state == TSM_UTF8_ACCEPT ||
-			    state == TSM_UTF8_REJECT) {
-				ucs4 = tsm_utf8_mach_get(vte->mach);
-				parse_data(vte, ucs4);
+			/* Decode up to the next printable ASCII character. It
+			 * might start another run for the fast path or be the
+			 * final character of a sequence that changes the input
+			 * mode, so it is always parsed on its own. */
+			if (!is_ascii_print(u8[i])) {
+				while (i + num < len &&
+				       num < UTF8_DECODE_LEN &&
+				       !is_ascii_print(u8[i + num]))
+					++num;
 			}
+
+			n = tsm_utf8_mach_decode(vte->mach, u8 + i, num, ucs4);
+			for (j = 0; j < n; ++j)
+				parse_data(vte, ucs4[j]);
 		}
 	}
+	flush_console(vte);
 	--vte->parse_cnt;
 }
 